@@ -89,6 +89,14 @@ LOCAL_MODULE_TAGS := optional
 
 LOCAL_SRC_FILES := \
 	gralloc_drm.cpp \
+	gralloc_drm_copy.c \
+	gralloc_drm_hash.c \
+	gralloc_drm_kms.c \
+	gralloc_drm_sample.c \
+	gralloc_drm_snapshot.cpp \
+	gralloc_drm_stats.c \
+	gralloc_drm_trace.c \
+	gralloc_drm_worker.c \
 	util.c
 
 LOCAL_C_INCLUDES := \
@@ -99,12 +107,18 @@ LOCAL_CFLAGS += -isystem vendor/intel/external/android_ia/hwcomposer/public \
 	-isystem vendor/intel/external/android_ia/hwcomposer/os/android
 
 LOCAL_SHARED_LIBRARIES := \
+	libdl \
 	libdrm \
 	liblog \
 	libcutils \
 	libhardware_legacy \
 	libutils
 
+ifeq ($(strip $(GRALLOC_DRM_ENABLE_LZ4)),true)
+LOCAL_CFLAGS += -DENABLE_LZ4
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
+
 ifneq ($(filter $(intel_drivers), $(DRM_GPU_DRIVERS)),)
 LOCAL_SRC_FILES += gralloc_drm_intel.c
 LOCAL_C_INCLUDES += vendor/intel/external/android_ia/libdrm/intel
@@ -190,5 +204,12 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_RELATIVE_PATH := hw
 include $(BUILD_SHARED_LIBRARY)
 
+# prints the dumps of GRALLOC_MODULE_PERFORM_DUMP_RECORDER
+include $(CLEAR_VARS)
+LOCAL_MODULE := gralloc_drm_trace_decode
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := gralloc_drm_trace_decode.c
+include $(BUILD_HOST_EXECUTABLE)
+
 endif # DRM_GPU_DRIVERS=prebuilt
 endif # DRM_GPU_DRIVERS
@@ -29,12 +29,23 @@
 #include <pthread.h>
 #include <errno.h>
 #include <map>
+#include <vector>
 
 #include "grallocbufferhandler.h"
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
 
-std::map<gralloc_drm_bo_t *, buffer_handle_t *> all_records;
+std::map<gralloc_drm_bo_t *, buffer_handle_t> all_records;
+/* guards all_records */
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void drm_mod_add_record(struct gralloc_drm_bo_t *bo,
+		buffer_handle_t handle)
+{
+	pthread_mutex_lock(&records_mutex);
+	all_records.insert(std::make_pair(bo, handle));
+	pthread_mutex_unlock(&records_mutex);
+}
 
 /*
  * Initialize the DRM device object
@@ -55,7 +66,7 @@ static int drm_init(struct drm_module_t *dmod)
 }
 
 static int drm_mod_create_buffer(struct drm_module_t *dmod,
-		int w, int h, int format, int usage,
+		int w, int h, int format, int usage, int layer_count,
 		buffer_handle_t *handle, int *stride)
 {
 	struct gralloc_drm_bo_t *bo;
@@ -71,15 +82,20 @@ static int drm_mod_create_buffer(struct drm_module_t *dmod,
 	if (!bpp)
 		return -EINVAL;
 
-	bo = gralloc_drm_bo_create(dmod->drm, w, h, format, usage);
+	/* BLOB buffers are 1D */
+	if (format == HAL_PIXEL_FORMAT_BLOB && h != 1)
+		return -EINVAL;
+
+	bo = gralloc_drm_bo_create_layered(dmod->drm, w, h, format, usage,
+			layer_count);
 	if (!bo)
 		return -ENOMEM;
 
 	*handle = gralloc_drm_bo_get_handle(bo, stride);
-	/* in pixels */
+	/* in pixels, or in bytes for packed formats (bpp is 1) */
 	*stride /= bpp;
 
-	all_records.insert(std::make_pair(bo, handle));
+	drm_mod_add_record(bo, *handle);
 
 	return 0;
 }
@@ -94,11 +110,15 @@ static int drm_mod_destroy_buffer(buffer_handle_t handle)
 
 	gralloc_drm_bo_decref(bo);
 
+	pthread_mutex_lock(&records_mutex);
 	std::map<gralloc_drm_bo_t *,
-		buffer_handle_t *>::const_iterator it = all_records.find(bo);
-	if (it == all_records.end())
+		buffer_handle_t>::iterator it = all_records.find(bo);
+	if (it == all_records.end()) {
+		pthread_mutex_unlock(&records_mutex);
 		return -EINVAL;
+	}
 	all_records.erase(it);
+	pthread_mutex_unlock(&records_mutex);
 
 	return 0;
 }
@@ -128,19 +148,16 @@ static int drm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 			buffer_handle_t handle = va_arg(args, buffer_handle_t);
 			struct HwcBuffer *hwc_bo = va_arg(args, struct HwcBuffer *);
 
-			gralloc_drm_handle_t *gr_handle = gralloc_drm_handle(handle);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
 
-			if (!gr_handle) {
+			if (!bo) {
 				ALOGE("could not find gralloc drm handle");
 				err = -EINVAL;
 				break;
 			}
 
 			/* call driver to resolve HwcBuffer */
-			if (dmod->drm->drv->resolve_buffer)
-				err = dmod->drm->drv->resolve_buffer(dmod->drm->drv, fd, gr_handle, hwc_bo);
-			else
-				err = -EINVAL;
+			err = gralloc_drm_bo_resolve_buffer(bo, fd, hwc_bo);
 		}
 		break;
 	case static_cast<int>(GRALLOC_MODULE_PERFORM_CREATE_BUFFER):
@@ -151,7 +168,350 @@ static int drm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 			int usage = va_arg(args, int);
 			buffer_handle_t* handle = va_arg(args, buffer_handle_t*);
 			int stride;
-			err = drm_mod_create_buffer(dmod, width, height, format, usage, handle, &stride);
+			err = drm_mod_create_buffer(dmod, width, height, format, usage, 1, handle, &stride);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_IMPORT_DMABUF):
+		{
+			int num_planes = va_arg(args, int);
+			const int *fds = va_arg(args, const int *);
+			uint32_t width = va_arg(args, uint32_t);
+			uint32_t height = va_arg(args, uint32_t);
+			int format = va_arg(args, int);
+			int usage = va_arg(args, int);
+			const uint32_t *offsets = va_arg(args, const uint32_t *);
+			const uint32_t *pitches = va_arg(args, const uint32_t *);
+			uint64_t modifier = va_arg(args, uint64_t);
+			buffer_handle_t *handle = va_arg(args, buffer_handle_t *);
+			struct gralloc_drm_bo_t *bo;
+
+			bo = gralloc_drm_bo_import(dmod->drm, width, height,
+					format, usage, num_planes, fds,
+					offsets, pitches, modifier);
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			*handle = gralloc_drm_bo_get_handle(bo, NULL);
+			drm_mod_add_record(bo, *handle);
+			err = 0;
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_CREATE_LAYERED_BUFFER):
+		{
+			uint32_t width = va_arg(args, uint32_t);
+			uint32_t height = va_arg(args, uint32_t);
+			int format = va_arg(args, int);
+			int usage = va_arg(args, int);
+			int layer_count = va_arg(args, int);
+			buffer_handle_t* handle = va_arg(args, buffer_handle_t*);
+			int *stride = va_arg(args, int *);
+			err = drm_mod_create_buffer(dmod, width, height, format, usage,
+					layer_count, handle, stride);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_GET_LAYER_LAYOUT):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int *layer_count = va_arg(args, int *);
+			int *layer_stride = va_arg(args, int *);
+			struct gralloc_drm_handle_t *gr_handle = gralloc_drm_handle(handle);
+
+			if (!gr_handle) {
+				err = -EINVAL;
+				break;
+			}
+
+			*layer_count = gr_handle->layer_count;
+			*layer_stride = gr_handle->layer_stride;
+			err = 0;
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_LOCK_LAYER):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int usage = va_arg(args, int);
+			int layer = va_arg(args, int);
+			int x = va_arg(args, int);
+			int y = va_arg(args, int);
+			int w = va_arg(args, int);
+			int h = va_arg(args, int);
+			void **addr = va_arg(args, void **);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_lock_layer(bo, usage, layer,
+					x, y, w, h, addr);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_LOCK_FLAGS):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int usage = va_arg(args, int);
+			int flags = va_arg(args, int);
+			int x = va_arg(args, int);
+			int y = va_arg(args, int);
+			int w = va_arg(args, int);
+			int h = va_arg(args, int);
+			void **addr = va_arg(args, void **);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_lock_flags(bo, usage, flags,
+					x, y, w, h, addr);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_PUBLISH_ROWS):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int y = va_arg(args, int);
+			int h = va_arg(args, int);
+			int *seq = va_arg(args, int *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_publish_rows(bo, y, h, seq);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_GET_PUBLISHED_ROWS):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int *rows = va_arg(args, int *);
+			int *seq = va_arg(args, int *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_get_published_rows(bo, rows, seq);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_WAIT_ROWS):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int rows = va_arg(args, int);
+			int timeout_ms = va_arg(args, int);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_wait_rows(bo, rows, timeout_ms);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_MARK_WRITTEN):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_mark_written(bo);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_GET_GENERATION):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int *generation = va_arg(args, int *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_get_generation(bo, generation);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_GET_DAMAGE):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int *count = va_arg(args, int *);
+			int *rects = va_arg(args, int *);
+			int max = va_arg(args, int);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_get_damage(bo, count, rects, max);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_SNAPSHOT):
+		{
+			int fd = va_arg(args, int);
+			int flags = va_arg(args, int);
+			std::vector<struct gralloc_drm_bo_t *> bos;
+			size_t i;
+
+			/* the bos may be freed while they are written */
+			pthread_mutex_lock(&records_mutex);
+			for (std::map<gralloc_drm_bo_t *, buffer_handle_t>::iterator it = all_records.begin();
+					it != all_records.end(); ++it) {
+				gralloc_drm_bo_incref(it->first);
+				bos.push_back(it->first);
+			}
+			pthread_mutex_unlock(&records_mutex);
+
+			err = gralloc_drm_snapshot(dmod->drm,
+					bos.empty() ? NULL : &bos[0], bos.size(),
+					fd, flags);
+
+			for (i = 0; i < bos.size(); i++)
+				gralloc_drm_bo_decref(bos[i]);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_RESTORE):
+		{
+			int fd = va_arg(args, int);
+			buffer_handle_t *handles = va_arg(args, buffer_handle_t *);
+			int max = va_arg(args, int);
+			int *count = va_arg(args, int *);
+			std::vector<struct gralloc_drm_bo_t *> bos(max > 0 ? max : 0);
+			int i;
+
+			err = gralloc_drm_restore(dmod->drm, fd,
+					bos.empty() ? NULL : &bos[0], max, count);
+			if (err)
+				break;
+
+			for (i = 0; i < *count; i++) {
+				handles[i] = gralloc_drm_bo_get_handle(bos[i], NULL);
+				drm_mod_add_record(bos[i], handles[i]);
+			}
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_EXPORT):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			buffer_handle_t *copy = va_arg(args, buffer_handle_t *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo || !copy) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_export(bo, copy);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_IS_SCANOUT_COMPATIBLE):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int *compatible = va_arg(args, int *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_is_scanout_compatible(bo, compatible);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_SET_DISPLAY_FD):
+		{
+			int fd = va_arg(args, int);
+
+			err = gralloc_drm_set_display_fd(dmod->drm, fd);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_GET_FB):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			uint32_t *fb_id = va_arg(args, uint32_t *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			err = gralloc_drm_bo_get_fb(bo, fb_id);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_FLUSH_FREES):
+		{
+			gralloc_drm_flush_frees(dmod->drm);
+			err = 0;
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_DUMP_RECORDER):
+		{
+			int fd = va_arg(args, int);
+
+			err = gralloc_drm_trace_dump(fd);
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_RESOLVE_FORMAT_LAYER):
+		{
+			buffer_handle_t handle = va_arg(args, buffer_handle_t);
+			int layer = va_arg(args, int);
+			uint32_t *pitches = va_arg(args, uint32_t *);
+			uint32_t *offsets = va_arg(args, uint32_t *);
+			uint32_t *handles = va_arg(args, uint32_t *);
+			struct gralloc_drm_bo_t *bo = gralloc_drm_bo_from_handle(handle);
+
+			if (!bo || layer < 0 || layer >= bo->handle->layer_count) {
+				err = -EINVAL;
+				break;
+			}
+
+			memset(pitches, 0, sizeof(uint32_t) * 4);
+			memset(offsets, 0, sizeof(uint32_t) * 4);
+			memset(handles, 0, sizeof(uint32_t) * 4);
+			gralloc_drm_resolve_format_layer(handle, layer,
+					pitches, offsets, handles);
+			err = 0;
+		}
+		break;
+	case static_cast<int>(GRALLOC_MODULE_PERFORM_CREATE_SUBRECT):
+		{
+			buffer_handle_t parent = va_arg(args, buffer_handle_t);
+			int x = va_arg(args, int);
+			int y = va_arg(args, int);
+			int w = va_arg(args, int);
+			int h = va_arg(args, int);
+			buffer_handle_t *handle = va_arg(args, buffer_handle_t *);
+			struct gralloc_drm_bo_t *parent_bo, *bo;
+
+			parent_bo = gralloc_drm_bo_from_handle(parent);
+			if (!parent_bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			bo = gralloc_drm_bo_create_subrect(parent_bo, x, y, w, h);
+			if (!bo) {
+				err = -EINVAL;
+				break;
+			}
+
+			*handle = gralloc_drm_bo_get_handle(bo, NULL);
+			drm_mod_add_record(bo, *handle);
+			err = 0;
 		}
 		break;
 	case static_cast<int>(GRALLOC_MODULE_PERFORM_DESTROY_BUFFER):
@@ -217,6 +577,9 @@ static int drm_mod_lock_ycbcr(const gralloc_module_t *mod, buffer_handle_t bhand
 	switch(handle->format) {
 	case HAL_PIXEL_FORMAT_YV12:
 	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
 		break;
 	default:
 		return -EINVAL;
@@ -243,6 +606,21 @@ static int drm_mod_lock_ycbcr(const gralloc_module_t *mod, buffer_handle_t bhand
 		ycbcr->cstride = pitches[1];
 		ycbcr->chroma_step = 1;
 		break;
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
+		{
+			/* CbCr interleaved, one or two bytes per sample */
+			int bpp = gralloc_drm_get_bpp(handle->format);
+
+			ycbcr->y = (uint8_t *)ptr + offsets[0];
+			ycbcr->cb = (uint8_t *)ptr + offsets[1];
+			ycbcr->cr = (uint8_t *)ptr + offsets[1] + bpp;
+			ycbcr->ystride = pitches[0];
+			ycbcr->cstride = pitches[1];
+			ycbcr->chroma_step = 2 * bpp;
+		}
+		break;
 	default:
 		break;
 	}
@@ -285,24 +663,40 @@ static int drm_mod_alloc_gpu0(alloc_device_t *dev,
 		buffer_handle_t *handle, int *stride)
 {
 	struct drm_module_t *dmod = (struct drm_module_t *) dev->common.module;
-	return drm_mod_create_buffer(dmod, w, h, format, usage, handle, stride);
+	return drm_mod_create_buffer(dmod, w, h, format, usage, 1, handle, stride);
 }
 
-static void drm_mod_dump_gpu0(struct alloc_device_t * /*dev*/, char *buff, int buff_len)
+static void drm_mod_dump_gpu0(struct alloc_device_t *dev, char *buff, int buff_len)
 {
+	struct drm_module_t *dmod = (struct drm_module_t *) dev->common.module;
 	int used = 0;
 
 	used += snprintf(buff+used, buff_len-used, "dump all buffer objects info:\n");
 
-	for(std::map<gralloc_drm_bo_t *, buffer_handle_t *>::iterator it=all_records.begin();
+	pthread_mutex_lock(&records_mutex);
+	for(std::map<gralloc_drm_bo_t *, buffer_handle_t>::iterator it=all_records.begin();
 			it!=all_records.end(); ++it) {
 		used += snprintf(buff+used, buff_len-used, "bo: %p, handle: %p, width: %d,"
 			" height: %d, format: %x, usage: %x\n", (*it).first, (*it).second,
 			(*it).first->handle->width, (*it).first->handle->height,
 			(*it).first->handle->format, (*it).first->handle->usage);
 		if (used >= buff_len)
-			return;
+			break;
 	}
+	pthread_mutex_unlock(&records_mutex);
+	if (used >= buff_len)
+		return;
+
+	used += snprintf(buff+used, buff_len-used, "recent buffer events:\n");
+	if (used >= buff_len)
+		return;
+	used += gralloc_drm_trace_print(buff+used, buff_len-used, 8);
+	if (used >= buff_len)
+		return;
+
+	if (dmod->drm && dmod->drm->sampler)
+		gralloc_drm_sampler_print(dmod->drm->sampler, buff+used,
+				buff_len-used);
 
 	return;
 }
@@ -24,19 +24,58 @@
 #define LOG_TAG "GRALLOC-DRM"
 
 #include <cutils/log.h>
+#include <cutils/ashmem.h>
 #include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/dma-buf.h>
+#include <linux/futex.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <drm_fourcc.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
+#include "util.h"
+
+/* older uapi headers predate dma-buf names */
+#ifndef DMA_BUF_SET_NAME
+#define DMA_BUF_SET_NAME _IOW(DMA_BUF_BASE, 1, const char *)
+#endif
+#ifndef DMA_BUF_NAME_LEN
+#define DMA_BUF_NAME_LEN 32
+#endif
+
+static uint64_t gralloc_drm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 /*
  * Return the pid of the process.
  */
@@ -119,6 +158,10 @@ struct gralloc_drm_t *gralloc_drm_create(void)
 		return NULL;
 	}
 
+	/* hash written rows so that rewriting them unchanged keeps the generation */
+	property_get("gralloc.drm.content_hash", path, "0");
+	drm->content_hash = atoi(path);
+
 	drm->drv = init_drv_from_fd(drm->fd);
 	if (!drm->drv) {
 		close(drm->fd);
@@ -126,6 +169,77 @@ struct gralloc_drm_t *gralloc_drm_create(void)
 		return NULL;
 	}
 
+	/* keep GEM handles only; handles go out through GRALLOC_MODULE_PERFORM_EXPORT */
+	property_get("gralloc.drm.deferred_export", path, "0");
+#ifdef USE_NAME
+	drm->deferred_export = 0;
+#else
+	drm->deferred_export = atoi(path) && drm->drv->export_fd;
+#endif
+	pthread_mutex_init(&drm->export_mutex, NULL);
+	memset(drm->exports, 0, sizeof(drm->exports));
+	drm->export_next = 0;
+
+	pthread_mutex_init(&drm->scanout_mutex, NULL);
+	drm->scanout_probed = 0;
+	drm->scanout = NULL;
+
+	/* bind and clear new HW_FB and cursor bos ahead of their first flip */
+	property_get("gralloc.drm.prewarm", path, "0");
+	drm->prewarm = atoi(path);
+	drm->display_fd = -1;
+	pthread_mutex_init(&drm->prewarm_mutex, NULL);
+	pthread_cond_init(&drm->prewarm_cond, NULL);
+	drm->worker = (drm->prewarm) ? gralloc_drm_worker_create(0) : NULL;
+
+	/* destroy freed bos off the caller's thread, at background priority */
+	property_get("gralloc.drm.deferred_free", path, "0");
+	pthread_mutex_init(&drm->free_mutex, NULL);
+	pthread_cond_init(&drm->free_cond, NULL);
+	drm->free_list = NULL;
+	drm->free_queued = 0;
+	drm->free_running = 0;
+	drm->free_worker = (atoi(path)) ?
+		gralloc_drm_worker_create(GRALLOC_DRM_FREE_NICE) : NULL;
+
+	/* name exported dma-bufs for the kernel's accounting, at an ioctl each */
+	property_get("gralloc.drm.dmabuf_names", path, "0");
+	drm->dmabuf_names = atoi(path);
+	memset(drm->dmabuf_client, 0, sizeof(drm->dmabuf_client));
+	if (drm->dmabuf_names) {
+		int comm = open("/proc/self/comm", O_RDONLY | O_CLOEXEC);
+		ssize_t len = (comm >= 0) ? read(comm, drm->dmabuf_client,
+				sizeof(drm->dmabuf_client) - 1) : -1;
+
+		if (len > 0 && drm->dmabuf_client[len - 1] == '\n')
+			drm->dmabuf_client[len - 1] = '\0';
+		else if (len <= 0)
+			strcpy(drm->dmabuf_client, "unknown");
+		if (comm >= 0)
+			close(comm);
+	}
+
+	/* record the backtrace of an allocation about every that many bytes */
+	property_get("gralloc.drm.sample_interval", path, "0");
+	drm->sampler = gralloc_drm_sampler_create(strtoul(path, NULL, 0));
+
+	/* serve counters for monitoring on an abstract socket of this name */
+	property_get("gralloc.drm.stats_socket", path, "");
+	drm->stats = NULL;
+	if (path[0]) {
+		drmVersionPtr version = drmGetVersion(drm->fd);
+
+		drm->stats = gralloc_drm_stats_create(path,
+				(version && version->name) ? version->name : "unknown");
+		if (version)
+			drmFreeVersion(version);
+	}
+
+	/* runtimes handle SIGSEGV themselves; dump the recorder on crashes only when asked */
+	property_get("gralloc.drm.recorder_dir", path, "");
+	if (path[0])
+		gralloc_drm_trace_install(path);
+
 	return drm;
 }
 
@@ -134,8 +248,38 @@ struct gralloc_drm_t *gralloc_drm_create(void)
  */
 void gralloc_drm_destroy(struct gralloc_drm_t *drm)
 {
+	int i;
+
+	/* queued jobs still use the driver; pre-warming may free bos */
+	if (drm->worker)
+		gralloc_drm_worker_destroy(drm->worker);
+	pthread_cond_destroy(&drm->prewarm_cond);
+	pthread_mutex_destroy(&drm->prewarm_mutex);
+
+	if (drm->free_worker) {
+		gralloc_drm_worker_destroy(drm->free_worker);
+		drm->free_worker = NULL;
+	}
+	gralloc_drm_flush_frees(drm);
+	pthread_cond_destroy(&drm->free_cond);
+	pthread_mutex_destroy(&drm->free_mutex);
+
+	for (i = 0; i < GRALLOC_DRM_EXPORT_CACHE_SIZE; i++) {
+		if (drm->exports[i].bo)
+			close(drm->exports[i].fd);
+	}
+	pthread_mutex_destroy(&drm->export_mutex);
+
+	if (drm->sampler)
+		gralloc_drm_sampler_destroy(drm->sampler);
+	if (drm->stats)
+		gralloc_drm_stats_destroy(drm->stats);
+
 	if (drm->drv)
 		drm->drv->destroy(drm->drv);
+	if (drm->scanout)
+		gralloc_drm_scanout_destroy(drm->scanout);
+	pthread_mutex_destroy(&drm->scanout_mutex);
 	close(drm->fd);
 	delete drm;
 }
@@ -148,6 +292,140 @@ int gralloc_drm_get_fd(struct gralloc_drm_t *drm)
 	return drm->fd;
 }
 
+/*
+ * Apply the codec constraints matching a format and usage.  The width and
+ * height are aligned in place; the padding the buffer needs on top of its
+ * planes is returned in rows and in bytes.  Either may be NULL.
+ */
+void gralloc_drm_codec_align(const struct gralloc_drm_codec_constraint_t *constraints,
+		int count, int format, int usage, int *width, int *height,
+		int *extra_rows, int *extra_bytes)
+{
+	int align_w = 1, align_h = 1, rows = 0, mb_bytes = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		const struct gralloc_drm_codec_constraint_t *c = &constraints[i];
+
+		if (c->format && c->format != format)
+			continue;
+		if (c->usage && !(c->usage & usage))
+			continue;
+
+		if (c->width_align > align_w)
+			align_w = c->width_align;
+		if (c->height_align > align_h)
+			align_h = c->height_align;
+		if (c->extra_rows > rows)
+			rows = c->extra_rows;
+		if (c->mb_extra_bytes > mb_bytes)
+			mb_bytes = c->mb_extra_bytes;
+	}
+
+	if (extra_rows)
+		*extra_rows = rows;
+	if (extra_bytes)
+		*extra_bytes = mb_bytes * (ALIGN(*width, 16) / 16) *
+			(ALIGN(*height, 16) / 16);
+
+	*width = ALIGN(*width, align_w);
+	*height = ALIGN(*height, align_h);
+}
+
+static size_t gralloc_drm_bo_storage_size(struct gralloc_drm_bo_t *bo);
+
+/* the flight recorder names bos by a counter, as addresses get reused */
+static volatile int32_t gralloc_drm_next_trace_id = 1;
+
+/*
+ * Initialize the lock state of a new bo.
+ */
+static void gralloc_drm_bo_init_lock(struct gralloc_drm_bo_t *bo)
+{
+	bo->lock_state = 0;
+	bo->lock_mapped = 0;
+	bo->lock_addr = NULL;
+	bo->write_bo = NULL;
+	bo->staging = NULL;
+	bo->staging_start = 0;
+	bo->staging_end = 0;
+	bo->prewarm_pending = 0;
+	bo->trace_id = android_atomic_inc(&gralloc_drm_next_trace_id);
+	bo->sample = NULL;
+	bo->sample_bytes = 0;
+	bo->stats_bytes = 0;
+	pthread_mutex_init(&bo->lock_mutex, NULL);
+}
+
+/*
+ * Pass fd as the meta_fd of a handle, counted as one more fd.
+ */
+static void gralloc_drm_handle_set_meta_fd(struct gralloc_drm_handle_t *handle,
+		int fd)
+{
+	handle->meta_fd = fd;
+	handle->base.numFds = GRALLOC_DRM_HANDLE_NUM_FDS +
+		GRALLOC_DRM_HANDLE_NUM_META_FDS;
+	handle->base.numInts = GRALLOC_DRM_HANDLE_NUM_DATA - handle->base.numFds;
+}
+
+/*
+ * Map the metadata shared by all processes using a bo.  A new bo with
+ * GRALLOC_DRM_USAGE_METADATA creates it first.  Other bos go without it,
+ * and without row publishing, generations and damage.
+ */
+static void gralloc_drm_bo_init_meta(struct gralloc_drm_bo_t *bo, int create)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	void *addr;
+	int fd;
+
+	bo->meta = NULL;
+
+	if (create) {
+		if (!GRALLOC_DRM_HANDLE_NUM_META_FDS ||
+		    !(handle->usage & GRALLOC_DRM_USAGE_METADATA))
+			return;
+
+		fd = ashmem_create_region("gralloc-drm-meta",
+				GRALLOC_DRM_META_SIZE);
+		if (fd < 0) {
+			ALOGE("failed to create metadata region");
+			return;
+		}
+		gralloc_drm_handle_set_meta_fd(handle, fd);
+	}
+
+	if (handle->meta_fd < 0)
+		return;
+
+	addr = mmap(NULL, GRALLOC_DRM_META_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, handle->meta_fd, 0);
+	if (addr == MAP_FAILED) {
+		ALOGE("failed to map metadata region");
+		return;
+	}
+
+	bo->meta = (struct gralloc_drm_meta_t *) addr;
+	if (create) {
+		bo->meta->magic = GRALLOC_DRM_META_MAGIC;
+		bo->meta->height = handle->height;
+		/* a buffer nobody writes is complete */
+		bo->meta->published_rows = handle->height;
+		bo->meta->publish_seq = 0;
+		bo->meta->generation = 0;
+		bo->meta->hash_valid = 0;
+		bo->meta->damage_node = 0;
+		bo->meta->damage_lock = 0;
+		bo->meta->damage_count = 0;
+	}
+	else if (bo->meta->magic != GRALLOC_DRM_META_MAGIC) {
+		ALOGE("invalid metadata region");
+		munmap(addr, GRALLOC_DRM_META_SIZE);
+		bo->meta = NULL;
+	}
+}
+
 /*
  * Validate a buffer handle and return the associated bo.
  */
@@ -175,6 +453,15 @@ static struct gralloc_drm_bo_t *validate_handle(struct gralloc_drm_handle_t *han
 			bo->imported = 1;
 			bo->handle = handle;
 			bo->refcount = 1;
+			gralloc_drm_bo_init_lock(bo);
+			gralloc_drm_bo_init_meta(bo, 0);
+			gralloc_drm_trace(GRALLOC_DRM_EVENT_IMPORT,
+					bo->trace_id,
+					gralloc_drm_bo_storage_size(bo),
+					handle->usage);
+			if (drm->stats)
+				gralloc_drm_stats_count(drm->stats,
+						GRALLOC_DRM_STAT_IMPORT);
 		}
 
 		handle->data_owner = gralloc_drm_get_pid();
@@ -234,174 +521,2333 @@ static struct gralloc_drm_handle_t *create_bo_handle(int width,
 	handle->height = height;
 	handle->format = format;
 	handle->usage = usage;
+#ifdef USE_NAME
+	handle->name = 0;
+#endif
 	handle->prime_fd = -1;
+	handle->meta_fd = -1;
+	handle->flags = 0;
+	handle->num_planes = 0;
+	handle->layer_count = 1;
+	handle->layer_stride = 0;
+	handle->offset = 0;
+	handle->modifier = 0;
 	handle->data = 0;
 
 	return handle;
 }
 
 /*
- * Create a bo.
+ * Add a framebuffer for a new bo on fd, a KMS fd of the compositor.  Call
+ * it before the handle leaves gralloc: only then is the GEM handle the
+ * import gets on fd not shared with an import of the compositor.
  */
-struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm,
-		int width, int height, int format, int usage)
+static int gralloc_drm_bo_add_fb(struct gralloc_drm_bo_t *bo, int fd)
 {
-	struct gralloc_drm_bo_t *bo;
-	struct gralloc_drm_handle_t *handle;
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	uint32_t pitches[4], offsets[4], handles[4];
+	uint32_t format, gem_handle, fb_id;
+	uint64_t modifiers[4];
+	struct drm_gem_close args;
+	/* a deferred export may be closed under us */
+	int prime_fd = (handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT) ?
+		-1 : handle->prime_fd;
+	int err, i;
+
+	/* our GEM handle means nothing on fd; go through a dma-buf */
+	if (prime_fd < 0) {
+		if (!drv->export_fd)
+			return -EINVAL;
+		err = drv->export_fd(drv, bo, &prime_fd);
+		if (err)
+			return err;
+	}
+	err = drmPrimeFDToHandle(fd, prime_fd, &gem_handle);
+	if (prime_fd != handle->prime_fd)
+		close(prime_fd);
+	if (err)
+		return err;
+
+	format = get_fourcc_format_for_hal_format(handle->format);
+	gralloc_drm_resolve_format((buffer_handle_t) handle, pitches, offsets,
+			handles);
+	for (i = 0; i < 4; i++) {
+		handles[i] = (pitches[i]) ? gem_handle : 0;
+		modifiers[i] = (pitches[i]) ? handle->modifier : 0;
+	}
 
-	handle = create_bo_handle(width, height, format, usage);
-	if (!handle)
-		return NULL;
+	if (handle->modifier != DRM_FORMAT_MOD_INVALID)
+		err = drmModeAddFB2WithModifiers(fd, handle->width,
+				handle->height, format, handles, pitches,
+				offsets, modifiers, &fb_id,
+				DRM_MODE_FB_MODIFIERS);
+	else
+		err = drmModeAddFB2(fd, handle->width, handle->height,
+				format, handles, pitches, offsets, &fb_id, 0);
 
-	bo = drm->drv->alloc(drm->drv, handle);
-	if (!bo) {
-		delete handle;
-		return NULL;
-	}
+	/* the framebuffer holds its own reference; the handle is ours alone */
+	memset(&args, 0, sizeof(args));
+	args.handle = gem_handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &args);
 
-	bo->drm = drm;
-	bo->imported = 0;
-	bo->handle = handle;
-	bo->fb_id = 0;
-	bo->refcount = 1;
+	if (err)
+		return err;
 
-	handle->data_owner = gralloc_drm_get_pid();
-	handle->data = bo;
+	bo->fb_id = fb_id;
 
-	return bo;
+	return 0;
 }
 
 /*
- * Destroy a bo.
+ * Pre-warm a bo on the worker thread: bind it for the display, which its
+ * first flip would otherwise wait for.  The client may already use the
+ * bo, so the contents are only read; new bos are zeroed by the kernel.
  */
-static void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
+static void gralloc_drm_bo_prewarm(void *data)
 {
-	struct gralloc_drm_handle_t *handle = bo->handle;
-	int imported = bo->imported;
+	struct gralloc_drm_bo_t *bo = (struct gralloc_drm_bo_t *) data;
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_drv_t *drv = drm->drv;
+	void *addr;
+	int err;
 
-	/* gralloc still has a reference */
-	if (bo->refcount)
-		return;
+	if (drm->stats)
+		gralloc_drm_stats_count(drm->stats, GRALLOC_DRM_STAT_DRV_PREWARM);
 
-	bo->drm->drv->free(bo->drm->drv, bo);
-	if (imported) {
-		handle->data_owner = 0;
-		handle->data = 0;
+	if (drv->prewarm) {
+		err = drv->prewarm(drv, bo);
 	}
 	else {
-               if (handle->prime_fd >= 0)
-                       close(handle->prime_fd);
+		/* faulting the pages in is the most we can do */
+		err = drv->map(drv, bo, 0, 0, bo->handle->width,
+				bo->handle->height, 0, &addr);
+		if (!err) {
+			size_t size = gralloc_drm_bo_storage_size(bo);
+			size_t page = sysconf(_SC_PAGESIZE);
+			size_t off;
+
+			for (off = 0; off < size; off += page)
+				(void) ((volatile uint8_t *) addr)[off];
+			drv->unmap(drv, bo);
+		}
+	}
+	if (err)
+		ALOGW("failed to pre-warm bo %p: %d", bo, err);
 
-		delete handle;
+	pthread_mutex_lock(&drm->prewarm_mutex);
+	android_atomic_release_store(0, &bo->prewarm_pending);
+	pthread_cond_broadcast(&drm->prewarm_cond);
+	pthread_mutex_unlock(&drm->prewarm_mutex);
+
+	gralloc_drm_bo_decref(bo);
+}
+
+/*
+ * Give a new HW_FB or cursor bo its framebuffer and queue it for
+ * pre-warming.  The worker holds a reference until it is done.
+ */
+static void gralloc_drm_bo_queue_prewarm(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int display_fd, err;
+
+	if (!drm->worker ||
+	    !(bo->handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_CURSOR)))
+		return;
+
+	pthread_mutex_lock(&drm->prewarm_mutex);
+	display_fd = drm->display_fd;
+	pthread_mutex_unlock(&drm->prewarm_mutex);
+
+	if (display_fd >= 0) {
+		err = gralloc_drm_bo_add_fb(bo, display_fd);
+		if (err)
+			ALOGW("failed to add a framebuffer for bo %p: %d",
+					bo, err);
+	}
+
+	bo->prewarm_pending = 1;
+	android_atomic_inc(&bo->refcount);
+	if (gralloc_drm_worker_queue(drm->worker, gralloc_drm_bo_prewarm, bo)) {
+		bo->prewarm_pending = 0;
+		android_atomic_dec(&bo->refcount);
 	}
 }
 
 /*
- * Decrease refcount, if no refs anymore then destroy.
+ * Wait until the worker is done pre-warming the storage of a bo.
  */
-void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo)
+static void gralloc_drm_bo_wait_prewarm(struct gralloc_drm_bo_t *bo)
 {
-	if (!--bo->refcount)
-		gralloc_drm_bo_destroy(bo);
+	struct gralloc_drm_t *drm = bo->drm;
+
+	if (bo->parent)
+		bo = bo->parent;
+
+	if (!android_atomic_acquire_load(&bo->prewarm_pending))
+		return;
+
+	pthread_mutex_lock(&drm->prewarm_mutex);
+	while (bo->prewarm_pending)
+		pthread_cond_wait(&drm->prewarm_cond, &drm->prewarm_mutex);
+	pthread_mutex_unlock(&drm->prewarm_mutex);
 }
 
 /*
- * Return the bo of a registered handle.
+ * Set the KMS fd of the compositor.  Pre-warmed bos get a framebuffer on
+ * it.  It can be set once.
  */
-struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t _handle)
+int gralloc_drm_set_display_fd(struct gralloc_drm_t *drm, int fd)
 {
-	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+	int err = 0;
 
-	if (!handle)
-		return NULL;
+	pthread_mutex_lock(&drm->prewarm_mutex);
+	if (drm->display_fd >= 0 && drm->display_fd != fd)
+		err = -EBUSY;
+	else
+		drm->display_fd = fd;
+	pthread_mutex_unlock(&drm->prewarm_mutex);
 
-	return handle->data;
+	return err;
 }
 
 /*
- * Get the buffer handle and stride of a bo.
+ * Return what the display planes accept, or NULL when the display is
+ * unknown.  The planes are probed on the KMS fd the compositor gave, and
+ * only once it was given; gralloc never opens the KMS device itself, as
+ * that could make a client DRM master ahead of the compositor.  Until
+ * then, bos are allocated without plane constraints.
  */
-buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride)
+static const struct gralloc_drm_scanout_t *gralloc_drm_get_scanout(
+		struct gralloc_drm_t *drm)
 {
-	if (stride)
-		*stride = bo->handle->stride;
-	return &bo->handle->base;
+	int fd;
+
+	pthread_mutex_lock(&drm->scanout_mutex);
+	if (!drm->scanout_probed) {
+		pthread_mutex_lock(&drm->prewarm_mutex);
+		fd = drm->display_fd;
+		pthread_mutex_unlock(&drm->prewarm_mutex);
+
+		if (fd >= 0) {
+			drm->scanout = gralloc_drm_scanout_create(fd);
+			drm->drv->scanout = drm->scanout;
+			drm->scanout_probed = 1;
+		}
+	}
+	pthread_mutex_unlock(&drm->scanout_mutex);
+
+	return drm->scanout;
 }
 
 /*
- * Query YUV component offsets for a buffer handle
+ * Return the framebuffer of a pre-warmed bo, or 0 when it has none.
  */
-void gralloc_drm_resolve_format(buffer_handle_t _handle,
-	uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
+int gralloc_drm_bo_get_fb(struct gralloc_drm_bo_t *bo, uint32_t *fb_id)
 {
-	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
-	struct gralloc_drm_bo_t *bo = handle->data;
-	struct gralloc_drm_t *drm = bo->drm;
+	gralloc_drm_bo_wait_prewarm(bo);
 
-	/* if handle exists and driver implements resolve_format */
-	if (handle && drm->drv->resolve_format)
-		drm->drv->resolve_format(drm->drv, bo,
-			pitches, offsets, handles);
+	/* an alias is not what the framebuffer shows */
+	*fb_id = (bo->parent) ? 0 : bo->fb_id;
+
+	return 0;
 }
 
 /*
- * Lock a bo.  XXX thread-safety?
+ * Create a bo.
  */
-int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
-		int usage, int x, int y, int w, int h,
-		void **addr)
+struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage)
 {
-	if ((bo->handle->usage & usage) != usage) {
-		/* make FB special for testing software renderer with */
+	return gralloc_drm_bo_create_layered(drm, width, height,
+			format, usage, 1);
+}
 
-		if (!(bo->handle->usage & GRALLOC_USAGE_HW_FB)
-		&&  !(bo->handle->usage & GRALLOC_USAGE_HW_TEXTURE)) {
-			ALOGE("bo.usage:x%X/usage:x%X is not GRALLOC_USAGE_HW_FB or GRALLOC_USAGE_HW_TEXTURE"
-				,bo->handle->usage,usage);
-			return -EINVAL;
-		}
+/*
+ * Return a short class for the usage of a buffer, from its main consumer.
+ */
+const char *gralloc_drm_usage_class(int usage)
+{
+	if (usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_COMPOSER))
+		return "disp";
+	if (usage & GRALLOC_USAGE_HW_CAMERA_MASK)
+		return "cam";
+	if (usage & GRALLOC_USAGE_HW_VIDEO_ENCODER)
+		return "venc";
+	if (usage & GRALLOC_USAGE_HW_RENDER)
+		return "rt";
+	if (usage & GRALLOC_USAGE_HW_TEXTURE)
+		return "tex";
+	if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+		return "cpu";
+
+	return "misc";
+}
+
+/*
+ * Name the dma-buf of a bo "<process>:<format>:<size class>:<usage class>"
+ * so that the kernel's dma-buf accounting can attribute it.  The size
+ * class is the size rounded up to a power of two.  An alias exports the
+ * dma-buf of its bo, which is named after that bo.
+ */
+static void gralloc_drm_bo_name_dmabuf(struct gralloc_drm_bo_t *bo, int fd)
+{
+	struct gralloc_drm_handle_t *handle;
+	char name[DMA_BUF_NAME_LEN];
+	size_t size, size_class = 4096;
+
+	if (bo->parent)
+		bo = bo->parent;
+	handle = bo->handle;
+	size = gralloc_drm_bo_storage_size(bo);
+
+	while (size_class < size)
+		size_class <<= 1;
+
+	snprintf(name, sizeof(name), "%s:%x:%zu%c:%s",
+			bo->drm->dmabuf_client, handle->format,
+			(size_class >= (1 << 20)) ? size_class >> 20 : size_class >> 10,
+			(size_class >= (1 << 20)) ? 'M' : 'K',
+			gralloc_drm_usage_class(handle->usage));
+
+	/* kernels before 5.3 have no names; older ones refuse attached bufs */
+	if (bo->drm->stats)
+		gralloc_drm_stats_count(bo->drm->stats,
+				GRALLOC_DRM_STAT_DMABUF_NAME);
+	if (ioctl(fd, DMA_BUF_SET_NAME, name))
+		ALOGV("failed to name dma-buf of bo %p: %s", bo, strerror(errno));
+}
+
+/*
+ * Create a bo holding layer_count images.  The driver lays the layers out
+ * back to back, layer_stride bytes apart.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_create_layered(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage, int layer_count)
+{
+	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_handle_t *handle;
+	uint64_t start = 0;
+	size_t size;
+
+	if (layer_count < 1 ||
+	    (layer_count > 1 && format == HAL_PIXEL_FORMAT_BLOB))
+		return NULL;
+
+	handle = create_bo_handle(width, height, format, usage);
+	if (!handle)
+		return NULL;
+
+	handle->layer_count = layer_count;
+	if (drm->deferred_export)
+		handle->flags |= GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT;
+
+	/* the driver lays these out for the planes */
+	if (usage & GRALLOC_DRM_USAGE_SCANOUT)
+		gralloc_drm_get_scanout(drm);
+
+	if (drm->stats) {
+		start = gralloc_drm_now_ns();
+		gralloc_drm_stats_count(drm->stats, GRALLOC_DRM_STAT_DRV_ALLOC);
 	}
 
-	/* allow multiple locks with compatible usages */
-	if (bo->lock_count && (bo->locked_for & usage) != usage)
-		return -EINVAL;
+	bo = drm->drv->alloc(drm->drv, handle);
+	if (!bo) {
+		if (drm->stats)
+			gralloc_drm_stats_count(drm->stats,
+					GRALLOC_DRM_STAT_ALLOC_FAIL);
+		delete handle;
+		return NULL;
+	}
+
+	bo->drm = drm;
+	bo->imported = 0;
+	bo->handle = handle;
+	bo->fb_id = 0;
+	bo->refcount = 1;
+	bo->parent = NULL;
+	gralloc_drm_bo_init_lock(bo);
+	gralloc_drm_bo_init_meta(bo, 1);
 
-	usage |= bo->locked_for;
+	handle->data_owner = gralloc_drm_get_pid();
+	handle->data = bo;
 
-	if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
-		     GRALLOC_USAGE_SW_READ_MASK)) {
-		/* the driver is supposed to wait for the bo */
-		int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-		int err = bo->drm->drv->map(bo->drm->drv, bo,
-				x, y, w, h, write, addr);
-		if (err)
-			return err;
+	size = gralloc_drm_bo_storage_size(bo);
+	gralloc_drm_trace(GRALLOC_DRM_EVENT_ALLOC, bo->trace_id, size, usage);
+	if (drm->dmabuf_names && handle->prime_fd >= 0)
+		gralloc_drm_bo_name_dmabuf(bo, handle->prime_fd);
+	if (drm->sampler)
+		gralloc_drm_sampler_alloc(drm->sampler, bo, size);
+	if (drm->stats) {
+		gralloc_drm_stats_alloc(drm->stats, format, usage, size,
+				gralloc_drm_now_ns() - start);
+		bo->stats_bytes = size;
 	}
-	else {
-		/* kernel handles the synchronization here */
+
+	gralloc_drm_bo_queue_prewarm(bo);
+
+	return bo;
+}
+
+/*
+ * Return the vertical subsampling of the planes after the first of a
+ * format.
+ */
+static int gralloc_drm_get_vsub(int format)
+{
+	switch (format) {
+	case HAL_PIXEL_FORMAT_YV12:
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
+		return 2;
+	default:
+		return 1;
 	}
+}
 
-	bo->lock_count++;
-	bo->locked_for |= usage;
+/*
+ * Check that the fds of the planes of an import refer to one dma-buf.
+ * Since linux 5.3, every dma-buf has an inode of its own.  Before, they
+ * all share the anonymous inode, and only the same fd proves it.
+ */
+static int gralloc_drm_same_dmabuf(const int *fds, int num_planes)
+{
+	struct stat st, plane_st, anon_st;
+	int anon, unique, i;
 
-	return 0;
+	if (fstat(fds[0], &st)) {
+		ALOGE("invalid dma-buf fd %d", fds[0]);
+		return 0;
+	}
+
+	/* the anonymous inode is that of any eventfd */
+	anon = eventfd(0, EFD_CLOEXEC);
+	if (anon < 0)
+		return 0;
+	unique = !fstat(anon, &anon_st) &&
+		(anon_st.st_dev != st.st_dev || anon_st.st_ino != st.st_ino);
+	close(anon);
+
+	for (i = 1; i < num_planes; i++) {
+		if (fds[i] == fds[0])
+			continue;
+
+		if (!unique || fstat(fds[i], &plane_st) ||
+		    plane_st.st_dev != st.st_dev ||
+		    plane_st.st_ino != st.st_ino) {
+			ALOGE("plane %d is not in the dma-buf of plane 0%s", i,
+					(unique) ? "" : "; pass the same fd for every plane");
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
 /*
- * Unlock a bo.
+ * Check the plane layout of an import against its format and the size of
+ * its dma-buf, so that locks and the display stay within the dma-buf.
  */
-void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo)
+static int gralloc_drm_check_import_layout(int fd, int width, int height,
+		int format, int num_planes, const uint32_t *offsets,
+		const uint32_t *pitches, off_t *size)
 {
-	int mapped = bo->locked_for &
-		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
+	int bpp = gralloc_drm_get_bpp(format);
+	int vsub = gralloc_drm_get_vsub(format);
+	int pixels, bytes, i;
+	uint64_t row;
+
+	*size = lseek(fd, 0, SEEK_END);
+	if (*size <= 0) {
+		ALOGE("failed to get the size of dma-buf fd %d", fd);
+		return 0;
+	}
 
-	if (!bo->lock_count)
-		return;
+	/* the rows of the first plane are at least as wide as the image */
+	gralloc_drm_get_packing(format, &pixels, &bytes);
+	row = (uint64_t) width / pixels * bytes * bpp;
+
+	for (i = 0; i < num_planes; i++) {
+		uint64_t rows = (i) ? (height + vsub - 1) / vsub : height;
+
+		if (!pitches[i] || (!i && pitches[i] < row) ||
+		    pitches[i] > INT_MAX || offsets[i] > INT_MAX ||
+		    offsets[i] + pitches[i] * rows > (uint64_t) *size) {
+			ALOGE("plane %d at %u, pitch %u, does not fit %dx%d "
+					"format 0x%x in %lld bytes", i,
+					offsets[i], pitches[i], width, height,
+					format, (long long) *size);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Wrap a dma-buf allocated elsewhere (V4L2, codecs, ...) in a bo.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_import(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage,
+		int num_planes, const int *fds, const uint32_t *offsets,
+		const uint32_t *pitches, uint64_t modifier)
+{
+	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_handle_t *handle;
+	off_t size;
+	int i;
+
+#ifdef USE_NAME
+	ALOGE("dma-buf import is not supported with flink names");
+	return NULL;
+#endif
 
-	if (mapped)
-		bo->drm->drv->unmap(bo->drm->drv, bo);
+	if (num_planes < 1 || num_planes > 4 || !fds || !offsets || !pitches ||
+	    width <= 0 || height <= 0)
+		return NULL;
+
+	if ((unsigned int) num_planes != planes_for_format(drm, format)) {
+		ALOGE("format 0x%x does not have %d planes", format, num_planes);
+		return NULL;
+	}
+
+	/* planes may come with their own fds but must share the dma-buf */
+	if (!gralloc_drm_same_dmabuf(fds, num_planes) ||
+	    !gralloc_drm_check_import_layout(fds[0], width, height, format,
+			    num_planes, offsets, pitches, &size))
+		return NULL;
+
+	handle = create_bo_handle(width, height, format, usage);
+	if (!handle)
+		return NULL;
+
+	handle->prime_fd = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+	if (handle->prime_fd < 0) {
+		ALOGE("failed to dup dma-buf fd %d", fds[0]);
+		delete handle;
+		return NULL;
+	}
+
+	handle->flags |= GRALLOC_DRM_HANDLE_FLAG_EXTERNAL;
+	handle->num_planes = num_planes;
+	for (i = 0; i < num_planes; i++) {
+		handle->offsets[i] = offsets[i];
+		handle->pitches[i] = pitches[i];
+	}
+	handle->stride = pitches[0];
+	handle->modifier = modifier;
+
+	bo = drm->drv->alloc(drm->drv, handle);
+	if (!bo) {
+		close(handle->prime_fd);
+		delete handle;
+		return NULL;
+	}
+
+	/* the dup'ed fd is ours; free it like any local bo */
+	bo->drm = drm;
+	bo->imported = 0;
+	bo->handle = handle;
+	bo->fb_id = 0;
+	bo->refcount = 1;
+	bo->parent = NULL;
+	bo->storage_size = size;
+	gralloc_drm_bo_init_lock(bo);
+	gralloc_drm_bo_init_meta(bo, 1);
+
+	handle->data_owner = gralloc_drm_get_pid();
+	handle->data = bo;
+
+	gralloc_drm_trace(GRALLOC_DRM_EVENT_IMPORT, bo->trace_id,
+			gralloc_drm_bo_storage_size(bo), usage);
+
+	return bo;
+}
+
+/*
+ * Return the number of planes of a format.
+ */
+unsigned int planes_for_format(struct gralloc_drm_t *drm, int hal_format)
+{
+	switch (hal_format) {
+	case HAL_PIXEL_FORMAT_YV12:
+	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+		return 3;
+	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Create a bo for a sub-rectangle of another bo.  The new bo shares the
+ * memory and stride of the parent and holds a reference to it.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_create_subrect(struct gralloc_drm_bo_t *parent,
+		int x, int y, int width, int height)
+{
+	struct gralloc_drm_handle_t *parent_handle = parent->handle;
+	struct gralloc_drm_handle_t *handle;
+	struct gralloc_drm_bo_t *bo, *root;
+	int bpp, pixels, bytes, offset, i;
+
+	/* only single-plane, unpacked, linear 2D images can be aliased */
+	bpp = gralloc_drm_get_bpp(parent_handle->format);
+	if (!bpp ||
+	    planes_for_format(parent->drm, parent_handle->format) != 1 ||
+	    gralloc_drm_get_packing(parent_handle->format, &pixels, &bytes) ||
+	    parent_handle->format == HAL_PIXEL_FORMAT_BLOB ||
+	    parent_handle->layer_count > 1 ||
+	    parent_handle->modifier != DRM_FORMAT_MOD_LINEAR) {
+		ALOGE("cannot alias format 0x%x, modifier 0x%llx",
+				parent_handle->format,
+				(unsigned long long) parent_handle->modifier);
+		return NULL;
+	}
+
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    x + width > parent_handle->width ||
+	    y + height > parent_handle->height)
+		return NULL;
+
+	offset = parent_handle->offset + y * parent_handle->stride + x * bpp;
+	if (offset % GRALLOC_DRM_SUBRECT_ALIGN) {
+		ALOGE("sub-rectangle offset %d is not %d byte aligned",
+				offset, GRALLOC_DRM_SUBRECT_ALIGN);
+		return NULL;
+	}
+
+	/* alias the bo that owns the memory, not another alias */
+	root = (parent->parent) ? parent->parent : parent;
+
+	handle = create_bo_handle(width, height, parent_handle->format,
+			parent_handle->usage);
+	if (!handle)
+		return NULL;
+
+	handle->flags = parent_handle->flags | GRALLOC_DRM_HANDLE_FLAG_SUBRECT;
+	handle->stride = parent_handle->stride;
+	handle->offset = offset;
+	handle->modifier = parent_handle->modifier;
+#ifdef USE_NAME
+	/* other processes import the alias through the name of the bo */
+	handle->name = root->handle->name;
+#endif
+	handle->num_planes = parent_handle->num_planes;
+	for (i = 0; i < parent_handle->num_planes; i++) {
+		handle->offsets[i] = parent_handle->offsets[i];
+		handle->pitches[i] = parent_handle->pitches[i];
+	}
+
+	/*
+	 * other processes import the alias through the same dma-buf, which
+	 * a deferred-export alias gets when it is exported
+	 */
+	if (!(handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT) &&
+	    root->handle->prime_fd >= 0) {
+		handle->prime_fd = fcntl(root->handle->prime_fd,
+				F_DUPFD_CLOEXEC, 0);
+		if (handle->prime_fd < 0) {
+			delete handle;
+			return NULL;
+		}
+	}
+
+	bo = new gralloc_drm_bo_t();
+	if (!bo) {
+		if (handle->prime_fd >= 0)
+			close(handle->prime_fd);
+		delete handle;
+		return NULL;
+	}
+
+	bo->drm = root->drm;
+	bo->imported = 0;
+	bo->handle = handle;
+	bo->fb_handle = root->fb_handle;
+	bo->fb_id = 0;
+	bo->refcount = 1;
+	bo->parent = root;
+	gralloc_drm_bo_init_lock(bo);
+	/* writes through the alias are writes to its bo */
+	if (root->handle->meta_fd >= 0) {
+		int fd = fcntl(root->handle->meta_fd, F_DUPFD_CLOEXEC, 0);
+
+		if (fd >= 0)
+			gralloc_drm_handle_set_meta_fd(handle, fd);
+	}
+	gralloc_drm_bo_init_meta(bo, 0);
+	android_atomic_inc(&root->refcount);
+
+	handle->data_owner = gralloc_drm_get_pid();
+	handle->data = bo;
+
+	return bo;
+}
+
+static void gralloc_drm_bo_unmap_locked(struct gralloc_drm_bo_t *bo);
+
+/*
+ * Drop the cached export of a deferred-export bo.
+ */
+static void gralloc_drm_bo_forget_export(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int i;
+
+	pthread_mutex_lock(&drm->export_mutex);
+	for (i = 0; i < GRALLOC_DRM_EXPORT_CACHE_SIZE; i++) {
+		if (drm->exports[i].bo == bo) {
+			close(drm->exports[i].fd);
+			drm->exports[i].bo = NULL;
+			drm->exports[i].pins = 0;
+		}
+	}
+	bo->handle->prime_fd = -1;
+	pthread_mutex_unlock(&drm->export_mutex);
+}
+
+/*
+ * Destroy a bo.
+ */
+static void gralloc_drm_bo_destroy(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	int imported = bo->imported;
+
+	/* gralloc still has a reference */
+	if (bo->refcount)
+		return;
+
+	gralloc_drm_trace(GRALLOC_DRM_EVENT_FREE, bo->trace_id,
+			gralloc_drm_bo_storage_size(bo), 0);
+	if (bo->drm->sampler)
+		gralloc_drm_sampler_free(bo->drm->sampler, bo);
+	if (bo->stats_bytes)
+		gralloc_drm_stats_free(bo->drm->stats, handle->format,
+				handle->usage, bo->stats_bytes);
+
+	/* front buffers and buffers freed while locked are still mapped */
+	if (bo->lock_mapped)
+		gralloc_drm_bo_unmap_locked(bo);
+	pthread_mutex_destroy(&bo->lock_mutex);
+	if (bo->meta)
+		munmap(bo->meta, GRALLOC_DRM_META_SIZE);
+	/* the export cache owns the fd */
+	if (!imported &&
+	    (handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT))
+		gralloc_drm_bo_forget_export(bo);
+
+	/* an alias owns its handle only */
+	if (bo->parent) {
+		struct gralloc_drm_bo_t *parent = bo->parent;
+
+		/* freed while locked for writing; the lock stays held */
+		pthread_mutex_lock(&parent->lock_mutex);
+		if (parent->write_bo == bo)
+			parent->write_bo = parent;
+		pthread_mutex_unlock(&parent->lock_mutex);
+
+		if (handle->prime_fd >= 0)
+			close(handle->prime_fd);
+		if (handle->meta_fd >= 0)
+			close(handle->meta_fd);
+		delete handle;
+		delete bo;
+
+		gralloc_drm_bo_decref(parent);
+		return;
+	}
+
+	if (bo->fb_id)
+		drmModeRmFB(bo->drm->display_fd, bo->fb_id);
+
+	bo->drm->drv->free(bo->drm->drv, bo);
+	if (imported) {
+		handle->data_owner = 0;
+		handle->data = 0;
+	}
+	else {
+               if (handle->prime_fd >= 0)
+                       close(handle->prime_fd);
+		if (handle->meta_fd >= 0)
+			close(handle->meta_fd);
+
+		delete handle;
+	}
+}
+
+/*
+ * Destroy the bos of a list linked through free_next.
+ */
+static void gralloc_drm_destroy_list(struct gralloc_drm_bo_t *bo)
+{
+	while (bo) {
+		struct gralloc_drm_bo_t *next = bo->free_next;
+
+		gralloc_drm_bo_destroy(bo);
+		bo = next;
+	}
+}
+
+/* non-zero on the free worker while it destroys a batch */
+static __thread int gralloc_drm_in_free_batch;
+
+/*
+ * Destroy the bos freed since the last batch, on the free worker.
+ */
+static void gralloc_drm_free_batch(void *data)
+{
+	struct gralloc_drm_t *drm = (struct gralloc_drm_t *) data;
+	struct gralloc_drm_bo_t *list;
+
+	pthread_mutex_lock(&drm->free_mutex);
+	list = drm->free_list;
+	drm->free_list = NULL;
+	drm->free_queued = 0;
+	drm->free_running = 1;
+	pthread_mutex_unlock(&drm->free_mutex);
+
+	gralloc_drm_in_free_batch = 1;
+	gralloc_drm_destroy_list(list);
+	gralloc_drm_in_free_batch = 0;
+
+	pthread_mutex_lock(&drm->free_mutex);
+	drm->free_running = 0;
+	pthread_cond_broadcast(&drm->free_cond);
+	pthread_mutex_unlock(&drm->free_mutex);
+}
+
+/*
+ * Hand a bo to the free worker.  Frees arriving while a batch is queued
+ * join it.
+ */
+static void gralloc_drm_bo_queue_free(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	int queue;
+
+	/*
+	 * the parent of an alias in the batch; flushing would wait for
+	 * the batch, so it goes right away
+	 */
+	if (gralloc_drm_in_free_batch) {
+		gralloc_drm_bo_destroy(bo);
+		return;
+	}
+
+	pthread_mutex_lock(&drm->free_mutex);
+	bo->free_next = drm->free_list;
+	drm->free_list = bo;
+	queue = !drm->free_queued;
+	drm->free_queued = 1;
+	pthread_mutex_unlock(&drm->free_mutex);
+
+	if (queue && gralloc_drm_worker_queue(drm->free_worker,
+				gralloc_drm_free_batch, drm))
+		gralloc_drm_flush_frees(drm);
+}
+
+/*
+ * Destroy every bo waiting for the free worker, on the calling thread.
+ * Return once the bos freed so far are gone, e.g. to trim memory.
+ */
+void gralloc_drm_flush_frees(struct gralloc_drm_t *drm)
+{
+	struct gralloc_drm_bo_t *list;
+
+	pthread_mutex_lock(&drm->free_mutex);
+	while (drm->free_running)
+		pthread_cond_wait(&drm->free_cond, &drm->free_mutex);
+	list = drm->free_list;
+	drm->free_list = NULL;
+	pthread_mutex_unlock(&drm->free_mutex);
+
+	gralloc_drm_destroy_list(list);
+}
+
+/*
+ * Increase refcount.
+ */
+void gralloc_drm_bo_incref(struct gralloc_drm_bo_t *bo)
+{
+	android_atomic_inc(&bo->refcount);
+}
+
+/*
+ * Decrease refcount, if no refs anymore then destroy.  With deferred
+ * frees, bos allocated by this process are destroyed by the free worker;
+ * imported ones are not, as the caller closes their handle right after.
+ */
+void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo)
+{
+	/* the pre-warm worker may drop the last reference */
+	if (android_atomic_dec(&bo->refcount) != 1)
+		return;
+
+	if (bo->drm->free_worker && !bo->imported)
+		gralloc_drm_bo_queue_free(bo);
+	else
+		gralloc_drm_bo_destroy(bo);
+}
+
+/*
+ * Return the bo of a registered handle.
+ */
+struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t _handle)
+{
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+
+	if (!handle)
+		return NULL;
+
+	return handle->data;
+}
+
+/*
+ * Get the buffer handle and stride of a bo.
+ */
+buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride)
+{
+	if (stride)
+		*stride = bo->handle->stride;
+	return &bo->handle->base;
+}
+
+/*
+ * Query YUV component offsets for a buffer handle
+ */
+void gralloc_drm_resolve_format(buffer_handle_t _handle,
+	uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
+{
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+	struct gralloc_drm_bo_t *bo;
+	struct gralloc_drm_t *drm;
+	int i;
+
+	if (!handle || !handle->data)
+		return;
+	bo = handle->data;
+	drm = bo->drm;
+
+	/* imported dma-bufs carry their own layout */
+	if (gralloc_drm_handle_get_layout(handle, bo->fb_handle,
+				pitches, offsets, handles)) {
+		/* nothing */
+	}
+	/* if the driver implements resolve_format */
+	else if (drm->drv->resolve_format) {
+		drm->drv->resolve_format(drm->drv,
+			(bo->parent) ? bo->parent : bo,
+			pitches, offsets, handles);
+	}
+	else {
+		return;
+	}
+
+	/* sub-rectangles start into the bo */
+	for (i = 0; i < 4 && handle->offset; i++) {
+		if (pitches[i])
+			offsets[i] += handle->offset;
+	}
+}
+
+/*
+ * Give a deferred-export bo a prime_fd from the export cache, evicting the
+ * oldest export that no resolve is using.  Called with export_mutex held.
+ * Return the slot holding the fd.
+ */
+static int gralloc_drm_bo_export_locked(struct gralloc_drm_bo_t *bo,
+		struct gralloc_drm_export_t **slot_ret)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	struct gralloc_drm_export_t *slot = NULL;
+	int fd, err, i;
+
+	if (drm->stats)
+		gralloc_drm_stats_count(drm->stats, (handle->prime_fd < 0) ?
+				GRALLOC_DRM_STAT_EXPORT_MISS :
+				GRALLOC_DRM_STAT_EXPORT_HIT);
+
+	if (handle->prime_fd >= 0) {
+		for (i = 0; i < GRALLOC_DRM_EXPORT_CACHE_SIZE; i++) {
+			if (drm->exports[i].bo == bo) {
+				*slot_ret = &drm->exports[i];
+				return 0;
+			}
+		}
+		return -EINVAL;
+	}
+
+	for (i = 0; i < GRALLOC_DRM_EXPORT_CACHE_SIZE; i++) {
+		slot = &drm->exports[(drm->export_next + i) %
+			GRALLOC_DRM_EXPORT_CACHE_SIZE];
+		if (!slot->pins)
+			break;
+	}
+	if (i == GRALLOC_DRM_EXPORT_CACHE_SIZE) {
+		ALOGE("all %d exports are in use", GRALLOC_DRM_EXPORT_CACHE_SIZE);
+		return -EBUSY;
+	}
+
+	if (drm->stats)
+		gralloc_drm_stats_count(drm->stats, GRALLOC_DRM_STAT_DRV_EXPORT);
+	/* an alias exports the dma-buf of its bo */
+	err = drm->drv->export_fd(drm->drv, (bo->parent) ? bo->parent : bo, &fd);
+	if (err) {
+		ALOGE("failed to export bo %p: %s", bo, strerror(-err));
+		return err;
+	}
+
+	if (slot->bo) {
+		close(slot->fd);
+		slot->bo->handle->prime_fd = -1;
+	}
+	slot->bo = bo;
+	slot->fd = fd;
+	slot->pins = 0;
+	drm->export_next = (slot - drm->exports + 1) %
+		GRALLOC_DRM_EXPORT_CACHE_SIZE;
+
+	handle->prime_fd = fd;
+	/* the export of an alias is that of its bo when the bo has one open */
+	if (drm->dmabuf_names &&
+	    !(bo->parent && bo->parent->handle->prime_fd >= 0))
+		gralloc_drm_bo_name_dmabuf(bo, fd);
+
+	*slot_ret = slot;
+
+	return 0;
+}
+
+/*
+ * Duplicate a handle with its own fds.
+ */
+static native_handle_t *gralloc_drm_handle_dup(
+		const struct gralloc_drm_handle_t *handle)
+{
+	int num_fds = handle->base.numFds;
+	native_handle_t *copy;
+	int i, j;
+
+	copy = native_handle_create(num_fds, handle->base.numInts);
+	if (!copy)
+		return NULL;
+
+	memcpy(copy->data, handle->base.data,
+			sizeof(int) * (num_fds + handle->base.numInts));
+	for (i = 0; i < num_fds; i++) {
+		if (copy->data[i] < 0)
+			continue;
+
+		copy->data[i] = fcntl(copy->data[i], F_DUPFD_CLOEXEC, 0);
+		if (copy->data[i] < 0) {
+			for (j = 0; j < i; j++) {
+				if (copy->data[j] >= 0)
+					close(copy->data[j]);
+			}
+			native_handle_delete(copy);
+			return NULL;
+		}
+	}
+
+	return copy;
+}
+
+/*
+ * Return a copy of the handle of a bo to send to another process.  The
+ * copy owns its fds, so the caller closes and deletes it once sent.  A
+ * bo allocated with deferred export gets a dma-buf from the export cache,
+ * which may close it again as soon as the copy is made.
+ */
+int gralloc_drm_bo_export(struct gralloc_drm_bo_t *bo,
+		buffer_handle_t *copy)
+{
+	struct gralloc_drm_t *drm = bo->drm;
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	struct gralloc_drm_export_t *slot;
+	int err = 0;
+
+	if (bo->imported ||
+	    !(handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT)) {
+		*copy = gralloc_drm_handle_dup(handle);
+		return (*copy) ? 0 : -ENOMEM;
+	}
+
+	pthread_mutex_lock(&drm->export_mutex);
+	err = gralloc_drm_bo_export_locked(bo, &slot);
+	if (!err) {
+		*copy = gralloc_drm_handle_dup(handle);
+		if (!*copy)
+			err = -ENOMEM;
+	}
+	pthread_mutex_unlock(&drm->export_mutex);
+
+	return err;
+}
+
+/*
+ * Check whether a display plane accepts a bo as it is laid out.
+ */
+int gralloc_drm_bo_is_scanout_compatible(struct gralloc_drm_bo_t *bo,
+		int *compatible)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	const struct gralloc_drm_scanout_t *scanout =
+		gralloc_drm_get_scanout(bo->drm);
+
+	if (!scanout)
+		return -ENODEV;
+
+	*compatible = gralloc_drm_scanout_supports(scanout,
+			get_fourcc_format_for_hal_format(handle->format),
+			handle->modifier, handle->width, handle->height);
+
+	return 0;
+}
+
+/*
+ * Resolve the HwcBuffer of a bo.
+ */
+int gralloc_drm_bo_resolve_buffer(struct gralloc_drm_bo_t *bo, int fd,
+		struct HwcBuffer *hwc_bo)
+{
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	struct gralloc_drm_export_t *slot = NULL;
+	int err, i;
+
+	if (!drv->resolve_buffer)
+		return -EINVAL;
+
+	gralloc_drm_bo_wait_prewarm(bo);
+
+	/*
+	 * the driver imports the dma-buf into fd; the cache keeps it open
+	 * until the import is done
+	 */
+	if (!root->imported &&
+	    (root->handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT)) {
+		pthread_mutex_lock(&bo->drm->export_mutex);
+		err = gralloc_drm_bo_export_locked(root, &slot);
+		if (!err)
+			slot->pins++;
+		pthread_mutex_unlock(&bo->drm->export_mutex);
+		if (err)
+			return err;
+	}
+
+	if (bo->drm->stats)
+		gralloc_drm_stats_count(bo->drm->stats,
+				GRALLOC_DRM_STAT_DRV_RESOLVE);
+	err = drv->resolve_buffer(drv, fd, root->handle, hwc_bo);
+	gralloc_drm_trace(GRALLOC_DRM_EVENT_RESOLVE, bo->trace_id, fd, err);
+
+	if (slot) {
+		pthread_mutex_lock(&bo->drm->export_mutex);
+		slot->pins--;
+		pthread_mutex_unlock(&bo->drm->export_mutex);
+	}
+	if (err)
+		return err;
+
+	if (bo->handle->flags & GRALLOC_DRM_HANDLE_FLAG_SUBRECT) {
+		hwc_bo->width = bo->handle->width;
+		hwc_bo->height = bo->handle->height;
+
+		for (i = 0; i < 4; i++) {
+			if (hwc_bo->pitches[i])
+				hwc_bo->offsets[i] += bo->handle->offset;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Query the offsets of a layer of a buffer handle
+ */
+void gralloc_drm_resolve_format_layer(buffer_handle_t _handle, int layer,
+	uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
+{
+	struct gralloc_drm_handle_t *handle = gralloc_drm_handle(_handle);
+	int i;
+
+	gralloc_drm_resolve_format(_handle, pitches, offsets, handles);
+
+	if (!handle || layer <= 0 || layer >= handle->layer_count)
+		return;
+
+	for (i = 0; i < 4; i++) {
+		if (pitches[i])
+			offsets[i] += layer * handle->layer_stride;
+	}
+}
+
+static int gralloc_drm_bo_lock_common(struct gralloc_drm_bo_t *bo,
+		int usage, int flags, int layer, int x, int y, int w, int h,
+		void **addr);
+
+/*
+ * Lock a layer of a bo.  y and h are rows of the layer.
+ */
+int gralloc_drm_bo_lock_layer(struct gralloc_drm_bo_t *bo,
+		int usage, int layer, int x, int y, int w, int h,
+		void **addr)
+{
+	if (layer < 0 || layer >= bo->handle->layer_count)
+		return -EINVAL;
+
+	return gralloc_drm_bo_lock_common(bo, usage, 0, layer,
+			x, y, w, h, addr);
+}
+
+/*
+ * Lock a bo.
+ */
+int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo,
+		int usage, int x, int y, int w, int h,
+		void **addr)
+{
+	return gralloc_drm_bo_lock_flags(bo, usage, 0, x, y, w, h, addr);
+}
+
+/*
+ * Return the size of the storage behind a bo, in bytes.
+ */
+static size_t gralloc_drm_bo_storage_size(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	struct gralloc_drm_handle_t *handle = root->handle;
+
+	if (root->storage_size)
+		return root->storage_size;
+
+	/* a deferred export may be closed under us; every process agrees on the layout */
+	if (handle->prime_fd >= 0 &&
+	    !(handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT)) {
+		off_t size = lseek(handle->prime_fd, 0, SEEK_END);
+
+		/* the size of a dma-buf never changes */
+		if (size > 0) {
+			root->storage_size = size;
+			return size;
+		}
+	}
+
+	if (handle->layer_stride)
+		return (size_t) handle->layer_stride * handle->layer_count;
+
+	return (size_t) handle->stride * handle->height;
+}
+
+/*
+ * Return the offset of a layer of a bo in the root mapping.
+ */
+static size_t gralloc_drm_bo_layer_offset(struct gralloc_drm_bo_t *bo,
+		int layer)
+{
+	return bo->handle->offset + (size_t) layer * bo->handle->layer_stride;
+}
+
+/*
+ * Return the byte range of the root mapping that rows y to y + h of a
+ * layer of a lock will touch.
+ */
+static void gralloc_drm_bo_lock_range(struct gralloc_drm_bo_t *bo,
+		int layer, int y, int h, size_t *start, size_t *end)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	size_t size = gralloc_drm_bo_storage_size(bo);
+	size_t base = gralloc_drm_bo_layer_offset(bo, layer);
+
+	if (y < 0)
+		y = 0;
+	*start = base + (size_t) y * handle->stride;
+	/* the last rows also pull in the planes that follow in the layer */
+	if (y + h >= handle->height)
+		*end = (handle->layer_stride) ?
+			base + handle->layer_stride : size;
+	else
+		*end = base + (size_t) (y + h) * handle->stride;
+	if (*end > size)
+		*end = size;
+}
+
+static int populate_supported;
+static pthread_once_t populate_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Check once whether the kernel knows MADV_POPULATE_WRITE, which needs
+ * linux 5.14.
+ */
+static void gralloc_drm_probe_populate(void)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *addr;
+
+	addr = mmap(NULL, page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return;
+
+	populate_supported = !madvise(addr, page, MADV_POPULATE_WRITE);
+	munmap(addr, page);
+}
+
+/*
+ * Fault in the pages of a fresh mapping that rows y to y + h of a lock
+ * will touch, in one call instead of one fault per page.
+ */
+static void gralloc_drm_bo_prefault(struct gralloc_drm_bo_t *bo,
+		void *addr, int write, int layer, int y, int h)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start, end;
+
+	gralloc_drm_bo_lock_range(bo, layer, y, h, &start, &end);
+	start &= ~(page - 1);
+	if (start >= end)
+		return;
+
+	pthread_once(&populate_once, gralloc_drm_probe_populate);
+	/* io mappings may refuse it; that only costs this lock the faults */
+	if (populate_supported &&
+	    !madvise((uint8_t *) addr + start, end - start,
+			(write) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ))
+		return;
+
+	madvise((uint8_t *) addr + start, end - start, MADV_WILLNEED);
+}
+
+/*
+ * Map a bo for all of its lock holders.  An alias locks through the bo
+ * owning its memory, which holds the mapping.  Called with the lock_mutex
+ * of that bo held.
+ */
+static int gralloc_drm_bo_map_locked(struct gralloc_drm_bo_t *bo,
+		int flags, int write, int layer, int x, int y, int w, int h)
+{
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	void *addr = NULL;
+	int err;
+
+	if (flags & GRALLOC_DRM_LOCK_UNSYNCHRONIZED) {
+		/* without the hook, map is the best we can do */
+		if (drv->map_unsynchronized)
+			err = drv->map_unsynchronized(drv, root,
+					x, y, w, h, write, &addr);
+		else
+			err = drv->map(drv, root, x, y, w, h, write, &addr);
+	}
+	else {
+		if ((flags & GRALLOC_DRM_LOCK_TRY) &&
+		    drv->busy && drv->busy(drv, root, write))
+			return -EBUSY;
+
+		/* the driver is supposed to wait for the bo */
+		err = drv->map(drv, root, x, y, w, h, write, &addr);
+	}
+	if (err)
+		return err;
+
+	if (flags & GRALLOC_DRM_LOCK_PREFAULT)
+		gralloc_drm_bo_prefault(bo, addr, write, layer, y, h);
+
+	root->lock_addr = addr;
+	android_atomic_release_store(1, &root->lock_mapped);
+
+	return 0;
+}
+
+/*
+ * Drop the mapping of a bo, or of the bo an alias locks through.  Called
+ * with the lock_mutex of that bo held.
+ */
+static void gralloc_drm_bo_unmap_locked(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+
+	if (!root->lock_mapped)
+		return;
+
+	root->drm->drv->unmap(root->drm->drv, root);
+	root->lock_addr = NULL;
+	android_atomic_release_store(0, &root->lock_mapped);
+
+	free(root->staging);
+	root->staging = NULL;
+	root->staging_start = 0;
+	root->staging_end = 0;
+}
+
+/*
+ * Copy rows y to y + h of a layer of a read-locked bo to its cached
+ * staging buffer and return the staging address matching lock_addr.  The
+ * staging buffer is shared by all readers, those of aliases included, and
+ * grows to cover the union of their rows.
+ */
+static int gralloc_drm_bo_stage(struct gralloc_drm_bo_t *bo,
+		int layer, int y, int h, void **addr)
+{
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	size_t size, start, end;
+	int err = 0;
+
+	/* reading a cached mapping directly is as fast as it gets */
+	if (drv->map_cached && drv->map_cached(drv, root)) {
+		*addr = root->lock_addr;
+		return 0;
+	}
+
+	size = gralloc_drm_bo_storage_size(bo);
+	gralloc_drm_bo_lock_range(bo, layer, y, h, &start, &end);
+	/* streaming loads want cache line aligned sources */
+	start &= ~((size_t) 63);
+	if (start >= end) {
+		*addr = root->lock_addr;
+		return 0;
+	}
+
+	pthread_mutex_lock(&root->lock_mutex);
+
+	if (!root->staging) {
+		void *staging;
+
+		if (posix_memalign(&staging, 64, ALIGN(size, 64))) {
+			ALOGE("failed to allocate %zu bytes for staging", size);
+			err = -ENOMEM;
+		}
+		else {
+			root->staging = (uint8_t *) staging;
+			root->staging_start = start;
+			root->staging_end = start;
+		}
+	}
+
+	if (!err) {
+		const uint8_t *src = (const uint8_t *) root->lock_addr;
+
+		/* copy what the rows of earlier readers did not cover */
+		if (start < root->staging_start) {
+			gralloc_drm_copy_from_uncached(root->staging + start,
+					src + start, root->staging_start - start);
+			root->staging_start = start;
+		}
+		if (end > root->staging_end) {
+			gralloc_drm_copy_from_uncached(
+					root->staging + root->staging_end,
+					src + root->staging_end,
+					end - root->staging_end);
+			root->staging_end = end;
+		}
+
+		*addr = root->staging;
+	}
+
+	pthread_mutex_unlock(&root->lock_mutex);
+
+	return err;
+}
+
+/*
+ * Return where a bo starts in the bo that owns its memory, which the
+ * shared metadata describes.  Other processes only have the handle of a
+ * sub-rectangle, so it is derived from the offset.
+ */
+static void gralloc_drm_bo_origin(struct gralloc_drm_bo_t *bo,
+		int *x, int *y)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	int bpp;
+
+	*x = 0;
+	*y = 0;
+	if (!(handle->flags & GRALLOC_DRM_HANDLE_FLAG_SUBRECT) ||
+	    !handle->stride)
+		return;
+
+	bpp = gralloc_drm_get_bpp(handle->format);
+	*y = handle->offset / handle->stride;
+	if (bpp)
+		*x = (handle->offset % handle->stride) / bpp;
+}
+
+/*
+ * Publish rows 0 to rows of the current frame and wake up the waiters.
+ * The rows count in the bo that owns the memory.  Return the new
+ * sequence number.
+ */
+static int32_t gralloc_drm_bo_publish(struct gralloc_drm_bo_t *bo,
+		int rows)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	int32_t seq;
+
+	if (!meta)
+		return 0;
+
+	/* the rows must land before their publication */
+	__sync_synchronize();
+
+	android_atomic_release_store(rows, &meta->published_rows);
+	seq = android_atomic_inc(&meta->publish_seq) + 1;
+
+	/* not FUTEX_PRIVATE_FLAG; the waiters may be in other processes */
+	syscall(__NR_futex, &meta->publish_seq, FUTEX_WAKE, INT_MAX,
+			NULL, NULL, 0);
+
+	return seq;
+}
+
+typedef void (*gralloc_drm_band_func_t)(struct gralloc_drm_bo_t *bo,
+		uint8_t *addr, size_t size, void *data);
+
+/*
+ * Call func on rows y to y + h of every plane of a layer of a mapped bo.
+ */
+static void gralloc_drm_bo_for_each_band(struct gralloc_drm_bo_t *bo,
+		int layer, int y, int h, gralloc_drm_band_func_t func,
+		void *data)
+{
+	uint32_t pitches[4], offsets[4], handles[4];
+	/* the offsets of an alias are into the mapping of its bo */
+	uint8_t *base = (uint8_t *) ((bo->parent) ? bo->parent : bo)->lock_addr;
+	int vsub, i;
+
+	if (!base)
+		return;
+
+	memset(pitches, 0, sizeof(pitches));
+	gralloc_drm_resolve_format_layer((buffer_handle_t) bo->handle, layer,
+			pitches, offsets, handles);
+	if (!pitches[0]) {
+		func(bo, base + gralloc_drm_bo_layer_offset(bo, layer) +
+				(size_t) y * bo->handle->stride,
+				(size_t) h * bo->handle->stride, data);
+		return;
+	}
+
+	vsub = gralloc_drm_get_vsub(bo->handle->format);
+
+	for (i = 0; i < 4; i++) {
+		int sub = (i) ? vsub : 1;
+		int first = y / sub;
+		int last = (y + h + sub - 1) / sub;
+
+		if (!pitches[i])
+			continue;
+
+		func(bo, base + offsets[i] + (size_t) first * pitches[i],
+				(size_t) (last - first) * pitches[i], data);
+	}
+}
+
+static void gralloc_drm_bo_flush_band(struct gralloc_drm_bo_t *bo,
+		uint8_t *addr, size_t size, void *data)
+{
+	struct gralloc_drm_drv_t *drv = bo->drm->drv;
+
+	drv->flush_range(drv, (bo->parent) ? bo->parent : bo, addr, size);
+}
+
+/*
+ * Flush the CPU cache for rows y to y + h of every plane of a layer of a
+ * locked bo.
+ */
+static void gralloc_drm_bo_flush_rows(struct gralloc_drm_bo_t *bo,
+		int layer, int y, int h)
+{
+	if (bo->drm->drv->flush_range)
+		gralloc_drm_bo_for_each_band(bo, layer, y, h,
+				gralloc_drm_bo_flush_band, NULL);
+}
+
+static void gralloc_drm_bo_hash_band(struct gralloc_drm_bo_t *bo,
+		uint8_t *addr, size_t size, void *data)
+{
+	uint64_t *hash = (uint64_t *) data;
+
+	*hash = gralloc_drm_hash(*hash, addr, size);
+}
+
+/*
+ * The robust futex list of the thread.  It holds the damage lock the
+ * thread owns, if any, so that the kernel marks the lock FUTEX_OWNER_DIED
+ * when the thread dies holding it.  Bionic has no robust mutexes and
+ * registers no list of its own.
+ */
+static __thread struct robust_list_head gralloc_drm_robust_head;
+/* the tid the list was registered for; a forked child has to redo it */
+static __thread int32_t gralloc_drm_robust_tid;
+
+static void gralloc_drm_register_robust_list(int32_t tid)
+{
+	struct robust_list_head *head = &gralloc_drm_robust_head;
+
+	if (gralloc_drm_robust_tid == tid)
+		return;
+
+	head->list.next = &head->list;
+	head->futex_offset = offsetof(struct gralloc_drm_meta_t, damage_lock) -
+		offsetof(struct gralloc_drm_meta_t, damage_node);
+	head->list_op_pending = NULL;
+	if (syscall(__NR_set_robust_list, head, sizeof(*head)))
+		ALOGE("failed to set the robust futex list: %s",
+				strerror(errno));
+
+	gralloc_drm_robust_tid = tid;
+}
+
+/*
+ * Take the damage lock of a bo, which any process using the bo may hold
+ * for a few dozen instructions.  It is a robust futex holding the tid of
+ * its owner, so the lock of a thread that died holding it is taken over.
+ * The kernel matches the tid against the dying thread itself, in its own
+ * pid namespace, so waiters never interpret it.
+ */
+static void gralloc_drm_meta_lock_damage(struct gralloc_drm_meta_t *meta)
+{
+	struct robust_list_head *head = &gralloc_drm_robust_head;
+	struct robust_list *node = (struct robust_list *) &meta->damage_node;
+	int32_t tid = syscall(SYS_gettid);
+	int32_t val, waiters = 0;
+
+	gralloc_drm_register_robust_list(tid);
+
+	/* a death from here on is handled through list_op_pending */
+	head->list_op_pending = node;
+
+	for (;;) {
+		val = android_atomic_acquire_load(&meta->damage_lock);
+		if (!(val & FUTEX_TID_MASK)) {
+			/* others may still sleep after we waited */
+			if (android_atomic_acquire_cas(val,
+					tid | (val & FUTEX_WAITERS) | waiters,
+					&meta->damage_lock))
+				continue;
+
+			if (val & FUTEX_OWNER_DIED) {
+				ALOGW("took over the damage lock of a dead thread");
+				/* the owner may have died halfway */
+				if (meta->damage_count < 0 ||
+				    meta->damage_count >
+				    GRALLOC_DRM_MAX_DAMAGE_RECTS)
+					meta->damage_count = 0;
+			}
+			break;
+		}
+
+		/* have the owner wake us up at unlock */
+		if (!(val & FUTEX_WAITERS) &&
+		    android_atomic_acquire_cas(val, val | FUTEX_WAITERS,
+			    &meta->damage_lock))
+			continue;
+
+		/* not FUTEX_PRIVATE_FLAG; the owner may be in another process */
+		syscall(__NR_futex, &meta->damage_lock, FUTEX_WAIT,
+				val | FUTEX_WAITERS, NULL, NULL, 0);
+		waiters = FUTEX_WAITERS;
+	}
+
+	node->next = &head->list;
+	head->list.next = node;
+	__sync_synchronize();
+	head->list_op_pending = NULL;
+}
+
+static void gralloc_drm_meta_unlock_damage(struct gralloc_drm_meta_t *meta)
+{
+	struct robust_list_head *head = &gralloc_drm_robust_head;
+	struct robust_list *node = (struct robust_list *) &meta->damage_node;
+	int32_t val;
+
+	head->list_op_pending = node;
+	head->list.next = &head->list;
+	val = __atomic_exchange_n(&meta->damage_lock, 0, __ATOMIC_RELEASE);
+	head->list_op_pending = NULL;
+
+	/* not FUTEX_PRIVATE_FLAG; the waiters may be in other processes */
+	if (val & FUTEX_WAITERS)
+		syscall(__NR_futex, &meta->damage_lock, FUTEX_WAKE, 1,
+				NULL, NULL, 0);
+}
+
+/*
+ * Add a rectangle to the damage of a bo.  When all slots are taken, it is
+ * merged into the rectangle that grows the least.
+ */
+static void gralloc_drm_bo_add_damage(struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	int x1, y1, x2, y2;
+	int ox, oy;
+	int best = 0, i;
+	int64_t best_growth = -1;
+
+	if (!meta)
+		return;
+
+	/* clip; an empty or bogus rectangle means everything */
+	x1 = (x > 0) ? x : 0;
+	y1 = (y > 0) ? y : 0;
+	x2 = (w > 0 && x + w < bo->handle->width) ? x + w : bo->handle->width;
+	y2 = (h > 0 && y + h < bo->handle->height) ? y + h : bo->handle->height;
+	if (x1 >= x2 || y1 >= y2) {
+		x1 = 0;
+		y1 = 0;
+		x2 = bo->handle->width;
+		y2 = bo->handle->height;
+	}
+
+	/* damage is kept in the coordinates of the whole bo */
+	gralloc_drm_bo_origin(bo, &ox, &oy);
+	x1 += ox;
+	x2 += ox;
+	y1 += oy;
+	y2 += oy;
+
+	gralloc_drm_meta_lock_damage(meta);
+
+	for (i = 0; i < meta->damage_count; i++) {
+		int32_t *r = meta->damage[i];
+		int ux1 = (r[0] < x1) ? r[0] : x1;
+		int uy1 = (r[1] < y1) ? r[1] : y1;
+		int ux2 = (r[0] + r[2] > x2) ? r[0] + r[2] : x2;
+		int uy2 = (r[1] + r[3] > y2) ? r[1] + r[3] : y2;
+		int64_t growth = (int64_t) (ux2 - ux1) * (uy2 - uy1) -
+			(int64_t) r[2] * r[3];
+
+		if (best_growth < 0 || growth < best_growth) {
+			best = i;
+			best_growth = growth;
+		}
+	}
+
+	if (best_growth == 0 ||
+	    meta->damage_count == GRALLOC_DRM_MAX_DAMAGE_RECTS) {
+		int32_t *r = meta->damage[best];
+
+		/* already covered, or no free slot */
+		if (r[0] < x1) x1 = r[0];
+		if (r[1] < y1) y1 = r[1];
+		if (r[0] + r[2] > x2) x2 = r[0] + r[2];
+		if (r[1] + r[3] > y2) y2 = r[1] + r[3];
+		i = best;
+	}
+	else {
+		i = meta->damage_count++;
+	}
+
+	meta->damage[i][0] = x1;
+	meta->damage[i][1] = y1;
+	meta->damage[i][2] = x2 - x1;
+	meta->damage[i][3] = y2 - y1;
+
+	gralloc_drm_meta_unlock_damage(meta);
+}
+
+/*
+ * Return and clear the damage of a bo, as up to max x, y, w, h
+ * rectangles.  If there are more, the bounding box is returned instead.
+ */
+int gralloc_drm_bo_get_damage(struct gralloc_drm_bo_t *bo,
+		int *count, int *rects, int max)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	int i;
+
+	if (!meta)
+		return -ENOSYS;
+	if (max < 1 || !count || !rects)
+		return -EINVAL;
+
+	gralloc_drm_meta_lock_damage(meta);
+
+	if (meta->damage_count <= max) {
+		for (i = 0; i < meta->damage_count; i++)
+			memcpy(&rects[i * 4], meta->damage[i],
+					sizeof(meta->damage[i]));
+		*count = meta->damage_count;
+	}
+	else {
+		int x1 = INT_MAX, y1 = INT_MAX, x2 = 0, y2 = 0;
+
+		for (i = 0; i < meta->damage_count; i++) {
+			int32_t *r = meta->damage[i];
+
+			if (r[0] < x1) x1 = r[0];
+			if (r[1] < y1) y1 = r[1];
+			if (r[0] + r[2] > x2) x2 = r[0] + r[2];
+			if (r[1] + r[3] > y2) y2 = r[1] + r[3];
+		}
+		rects[0] = x1;
+		rects[1] = y1;
+		rects[2] = x2 - x1;
+		rects[3] = y2 - y1;
+		*count = 1;
+	}
+	meta->damage_count = 0;
+
+	gralloc_drm_meta_unlock_damage(meta);
+
+	return 0;
+}
+
+/*
+ * Bump the generation of a bo after a write to rows y to y + h of a
+ * layer, unless content hashing shows that the same rows were rewritten
+ * unchanged.  Called with the mapping still in place.  Return non-zero
+ * when the generation changed.
+ */
+static int gralloc_drm_bo_update_generation(struct gralloc_drm_bo_t *bo,
+		int layer, int y, int h)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	uint64_t hash;
+	int ox, oy;
+
+	if (!meta)
+		return 0;
+
+	if (y < 0 || h <= 0 || y + h > bo->handle->height) {
+		y = 0;
+		h = bo->handle->height;
+	}
+
+	if (bo->drm->content_hash) {
+		/*
+		 * the same rows of another layer, or of an alias at another
+		 * column, are other pixels
+		 */
+		gralloc_drm_bo_origin(bo, &ox, &oy);
+		hash = (uint64_t) layer | (uint64_t) ox << 32;
+		gralloc_drm_bo_for_each_band(bo, layer, y, h,
+				gralloc_drm_bo_hash_band, &hash);
+
+		/* aliases share the hash of their bo */
+		y += oy;
+		if (meta->hash_valid && meta->hash_y == y &&
+		    meta->hash_h == h && meta->hash == hash)
+			return 0;
+
+		meta->hash_y = y;
+		meta->hash_h = h;
+		meta->hash = hash;
+		meta->hash_valid = 1;
+	}
+
+	android_atomic_inc(&meta->generation);
+
+	return 1;
+}
+
+/*
+ * Declare that the GPU or another device wrote to a bo.
+ */
+int gralloc_drm_bo_mark_written(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+
+	if (!meta)
+		return -ENOSYS;
+
+	/* the last CPU hash says nothing about the new content */
+	meta->hash_valid = 0;
+	android_atomic_inc(&meta->generation);
+	gralloc_drm_bo_add_damage(bo, 0, 0, 0, 0);
+
+	return 0;
+}
+
+/*
+ * Return the content generation of a bo.  It changes whenever the content
+ * may have changed.
+ */
+int gralloc_drm_bo_get_generation(struct gralloc_drm_bo_t *bo,
+		int *generation)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+
+	if (!meta)
+		return -ENOSYS;
+
+	*generation = android_atomic_acquire_load(&meta->generation);
+
+	return 0;
+}
+
+/*
+ * Publish rows y to y + h of a bo locked for writing, so that consumers
+ * can start on them before the writer unlocks.  Bands are published top
+ * to bottom; y must not be below the rows published so far.
+ */
+int gralloc_drm_bo_publish_rows(struct gralloc_drm_bo_t *bo,
+		int y, int h, int *seq)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	int32_t published;
+	int ox, oy, end;
+
+	if (!meta)
+		return -ENOSYS;
+
+	/* only the writer holding the lock publishes */
+	if (android_atomic_acquire_load(&root->lock_state) != -1 ||
+	    root->write_bo != bo)
+		return -EINVAL;
+
+	gralloc_drm_bo_origin(bo, &ox, &oy);
+	published = meta->published_rows - oy;
+	if (y < 0 || h <= 0 || y > published)
+		return -EINVAL;
+
+	end = y + h;
+	if (end > bo->handle->height)
+		end = bo->handle->height;
+	if (end < published)
+		end = published;
+
+	gralloc_drm_bo_flush_rows(bo, root->write_layer, y, end - y);
+
+	published = gralloc_drm_bo_publish(bo, oy + end);
+	if (seq)
+		*seq = published;
+
+	return 0;
+}
+
+/*
+ * Return the published rows of the current frame of a bo and the
+ * sequence number of the last publish.
+ */
+int gralloc_drm_bo_get_published_rows(struct gralloc_drm_bo_t *bo,
+		int *rows, int *seq)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	int ox, oy;
+
+	if (!meta)
+		return -ENOSYS;
+
+	if (seq)
+		*seq = android_atomic_acquire_load(&meta->publish_seq);
+	if (rows) {
+		/* the rows of the alias among the published rows of its bo */
+		gralloc_drm_bo_origin(bo, &ox, &oy);
+		*rows = android_atomic_acquire_load(&meta->published_rows) -
+			oy;
+		if (*rows < 0)
+			*rows = 0;
+		if (*rows > bo->handle->height)
+			*rows = bo->handle->height;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until at least rows rows of the current frame of a bo are
+ * published.  A negative timeout waits forever.
+ */
+int gralloc_drm_bo_wait_rows(struct gralloc_drm_bo_t *bo,
+		int rows, int timeout_ms)
+{
+	struct gralloc_drm_meta_t *meta = bo->meta;
+	struct timespec deadline, now, rel;
+	int ox, oy;
+
+	if (!meta)
+		return -ENOSYS;
+
+	if (rows > bo->handle->height)
+		rows = bo->handle->height;
+	gralloc_drm_bo_origin(bo, &ox, &oy);
+	rows += oy;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout_ms > 0) {
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	for (;;) {
+		int32_t seq = android_atomic_acquire_load(&meta->publish_seq);
+		struct timespec *timeout = NULL;
+
+		if (android_atomic_acquire_load(&meta->published_rows) >= rows)
+			return 0;
+
+		if (timeout_ms >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			rel.tv_sec = deadline.tv_sec - now.tv_sec;
+			rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (rel.tv_nsec < 0) {
+				rel.tv_sec--;
+				rel.tv_nsec += 1000000000;
+			}
+			if (rel.tv_sec < 0)
+				return -ETIMEDOUT;
+			timeout = &rel;
+		}
+
+		syscall(__NR_futex, &meta->publish_seq, FUTEX_WAIT, seq,
+				timeout, NULL, 0);
+	}
+}
+
+/*
+ * Take a shared read lock.  Readers join an existing lock without the
+ * mutex; only the transitions from and to unlocked take it.  An alias
+ * shares the lock of the bo owning its memory.
+ */
+static int gralloc_drm_bo_lock_read(struct gralloc_drm_bo_t *bo,
+		int flags, int need_map, int layer, int x, int y, int w, int h)
+{
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	int32_t state;
+	int joined = 0;
+	int err = 0;
+
+	state = android_atomic_acquire_load(&root->lock_state);
+	while (state > 0) {
+		if (!android_atomic_acquire_cas(state, state + 1,
+					&root->lock_state)) {
+			/* holding a reference keeps the mapping alive */
+			if (!need_map ||
+			    android_atomic_acquire_load(&root->lock_mapped))
+				return 0;
+
+			/* earlier readers did not need a mapping */
+			joined = 1;
+			break;
+		}
+		state = android_atomic_acquire_load(&root->lock_state);
+	}
+
+	pthread_mutex_lock(&root->lock_mutex);
+
+	if (!joined && root->lock_state < 0)
+		err = -EBUSY;
+	if (!err && need_map && !root->lock_mapped)
+		err = gralloc_drm_bo_map_locked(bo, flags, 0, layer,
+				x, y, w, h);
+
+	if (!err && !joined)
+		android_atomic_inc(&root->lock_state);
+	else if (err && joined)
+		android_atomic_dec(&root->lock_state);
+
+	pthread_mutex_unlock(&root->lock_mutex);
+
+	return err;
+}
+
+/*
+ * Take an exclusive write lock.  It excludes every other lock of the bo
+ * owning the memory, those of its aliases included.
+ */
+static int gralloc_drm_bo_lock_write(struct gralloc_drm_bo_t *bo,
+		int flags, int layer, int x, int y, int w, int h)
+{
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	int err = 0;
+
+	pthread_mutex_lock(&root->lock_mutex);
+
+	if (root->lock_state)
+		err = -EBUSY;
+	else
+		err = gralloc_drm_bo_map_locked(bo, flags, 1, layer,
+				x, y, w, h);
+	if (!err) {
+		root->write_bo = bo;
+		root->write_layer = layer;
+		root->write_x = x;
+		root->write_y = y;
+		root->write_w = w;
+		root->write_h = h;
+
+		/*
+		 * a new frame; nothing of it is published yet, but the rows
+		 * above an alias are not part of its frame
+		 */
+		if (bo->meta) {
+			int ox, oy;
+
+			gralloc_drm_bo_origin(bo, &ox, &oy);
+			android_atomic_release_store(oy,
+					&bo->meta->published_rows);
+		}
+		android_atomic_release_store(-1, &root->lock_state);
+	}
+
+	pthread_mutex_unlock(&root->lock_mutex);
+
+	return err;
+}
+
+/*
+ * Lock a front buffer.  It is mapped once, on the first lock, and stays
+ * mapped until it is freed.
+ */
+static int gralloc_drm_bo_lock_front(struct gralloc_drm_bo_t *bo,
+		int usage, int layer, int x, int y, int w, int h, void **addr)
+{
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	int err = 0;
+
+	if (!(usage & (GRALLOC_USAGE_SW_WRITE_MASK |
+		       GRALLOC_USAGE_SW_READ_MASK)))
+		return 0;
+
+	/* the writes land while the buffer is locked */
+	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+		gralloc_drm_bo_add_damage(bo, x, y, w, h);
+
+	if (!android_atomic_acquire_load(&root->lock_mapped)) {
+		pthread_mutex_lock(&root->lock_mutex);
+		if (!root->lock_mapped)
+			err = gralloc_drm_bo_map_locked(bo,
+					GRALLOC_DRM_LOCK_PREFAULT, 1, 0,
+					0, 0, bo->handle->width,
+					bo->handle->height);
+		pthread_mutex_unlock(&root->lock_mutex);
+		if (err)
+			return err;
+	}
+
+	*addr = (uint8_t *) root->lock_addr +
+		gralloc_drm_bo_layer_offset(bo, layer);
+
+	return 0;
+}
+
+/*
+ * Lock a bo, see gralloc_drm_bo_lock_flags.
+ */
+static int gralloc_drm_bo_do_lock(struct gralloc_drm_bo_t *bo,
+		int usage, int flags, int layer, int x, int y, int w, int h,
+		void **addr)
+{
+	int need_map;
+	int err;
+
+	gralloc_drm_bo_wait_prewarm(bo);
+
+	if ((bo->handle->usage & usage) != usage) {
+		/* make FB special for testing software renderer with */
+
+		if (!(bo->handle->usage & GRALLOC_USAGE_HW_FB)
+		&&  !(bo->handle->usage & GRALLOC_USAGE_HW_TEXTURE)) {
+			ALOGE("bo.usage:x%X/usage:x%X is not GRALLOC_USAGE_HW_FB or GRALLOC_USAGE_HW_TEXTURE"
+				,bo->handle->usage,usage);
+			return -EINVAL;
+		}
+	}
+
+	/* front buffers stay mapped; lock and unlock do no work */
+	if (bo->handle->usage & GRALLOC_DRM_USAGE_FRONT_BUFFER)
+		return gralloc_drm_bo_lock_front(bo, usage, layer,
+				x, y, w, h, addr);
+
+	/* without SW usage, the kernel handles the synchronization */
+	need_map = !!(usage & (GRALLOC_USAGE_SW_WRITE_MASK |
+			       GRALLOC_USAGE_SW_READ_MASK));
+
+	/* a staging buffer is a snapshot; writes to it would be lost */
+	if ((flags & GRALLOC_DRM_LOCK_STAGED) &&
+	    (usage & GRALLOC_USAGE_SW_WRITE_MASK))
+		return -EINVAL;
+
+	/* most of the buffer will be touched; fault it in up front */
+	if (need_map && w > 0 && h > 0 &&
+	    (int64_t) w * h * 4 >=
+	    (int64_t) bo->handle->width * bo->handle->height * 3)
+		flags |= GRALLOC_DRM_LOCK_PREFAULT;
+
+	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+		err = gralloc_drm_bo_lock_write(bo, flags, layer, x, y, w, h);
+	else
+		err = gralloc_drm_bo_lock_read(bo, flags, need_map, layer,
+				x, y, w, h);
+	if (err)
+		return err;
+
+	if (need_map) {
+		void *base = ((bo->parent) ? bo->parent : bo)->lock_addr;
+
+		if (flags & GRALLOC_DRM_LOCK_STAGED) {
+			err = gralloc_drm_bo_stage(bo, layer, y, h, &base);
+			if (err) {
+				gralloc_drm_bo_unlock(bo);
+				return err;
+			}
+		}
+
+		*addr = (uint8_t *) base +
+			gralloc_drm_bo_layer_offset(bo, layer);
+	}
+
+	return 0;
+}
+
+/*
+ * Lock a layer of a bo, recording the lock for the flight recorder and
+ * the stats.
+ */
+static int gralloc_drm_bo_lock_common(struct gralloc_drm_bo_t *bo,
+		int usage, int flags, int layer, int x, int y, int w, int h,
+		void **addr)
+{
+	struct gralloc_drm_stats_t *stats = bo->drm->stats;
+	uint64_t start = (stats) ? gralloc_drm_now_ns() : 0;
+	int err;
+
+	err = gralloc_drm_bo_do_lock(bo, usage, flags, layer,
+			x, y, w, h, addr);
+	gralloc_drm_trace(GRALLOC_DRM_EVENT_LOCK, bo->trace_id, usage, err);
+	if (stats)
+		gralloc_drm_stats_lock(stats, gralloc_drm_now_ns() - start);
+
+	return err;
+}
+
+/*
+ * Lock a bo with GRALLOC_DRM_LOCK_* flags.  Any number of SW_READ lockers
+ * share one mapping, while a SW_WRITE locker is exclusive.  A conflicting
+ * lock fails with -EBUSY.
+ */
+int gralloc_drm_bo_lock_flags(struct gralloc_drm_bo_t *bo,
+		int usage, int flags, int x, int y, int w, int h,
+		void **addr)
+{
+	return gralloc_drm_bo_lock_common(bo, usage, flags, 0,
+			x, y, w, h, addr);
+}
+
+/*
+ * Lock the whole storage of a bo for gralloc's own copies, regardless of
+ * its usage.  Return the mapping and its size.  Unlock with
+ * gralloc_drm_bo_unlock.
+ */
+int gralloc_drm_bo_lock_storage(struct gralloc_drm_bo_t *bo, int write,
+		void **addr, size_t *size)
+{
+	struct gralloc_drm_handle_t *handle = bo->handle;
+	void *front;
+	int err;
+
+	gralloc_drm_bo_wait_prewarm(bo);
+
+	if (handle->usage & GRALLOC_DRM_USAGE_FRONT_BUFFER)
+		err = gralloc_drm_bo_lock_front(bo, write ?
+				GRALLOC_USAGE_SW_WRITE_OFTEN :
+				GRALLOC_USAGE_SW_READ_OFTEN,
+				0, 0, 0, handle->width, handle->height, &front);
+	else if (write)
+		err = gralloc_drm_bo_lock_write(bo, GRALLOC_DRM_LOCK_PREFAULT,
+				0, 0, 0, handle->width, handle->height);
+	else
+		err = gralloc_drm_bo_lock_read(bo, GRALLOC_DRM_LOCK_PREFAULT,
+				1, 0, 0, 0, handle->width, handle->height);
+	if (err)
+		return err;
+
+	*addr = ((bo->parent) ? bo->parent : bo)->lock_addr;
+	*size = gralloc_drm_bo_storage_size(bo);
+
+	return 0;
+}
+
+/*
+ * Unlock a bo.  The mapping goes away with the last holder, of the bo or
+ * of any of its aliases.
+ */
+void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_bo_t *root = (bo->parent) ? bo->parent : bo;
+	int32_t state;
+
+	gralloc_drm_trace(GRALLOC_DRM_EVENT_UNLOCK, bo->trace_id,
+			root->lock_state, 0);
+
+	if (bo->handle->usage & GRALLOC_DRM_USAGE_FRONT_BUFFER) {
+		/* drain write-combining buffers; the memory is coherent */
+		__sync_synchronize();
+		/* the lock may have been a write; assume it was */
+		if (bo->meta)
+			android_atomic_inc(&bo->meta->generation);
+		return;
+	}
+
+	/* other readers remain */
+	state = android_atomic_acquire_load(&root->lock_state);
+	while (state > 1) {
+		if (!android_atomic_release_cas(state, state - 1,
+					&root->lock_state))
+			return;
+		state = android_atomic_acquire_load(&root->lock_state);
+	}
+
+	if (!state)
+		return;
+
+	pthread_mutex_lock(&root->lock_mutex);
+
+	for (;;) {
+		state = root->lock_state;
+		if (state > 1) {
+			if (!android_atomic_release_cas(state, state - 1,
+						&root->lock_state))
+				break;
+		}
+		else if (state == 1 || state == -1) {
+			if (!android_atomic_release_cas(state, 0,
+						&root->lock_state)) {
+				/* the writer may be an alias */
+				struct gralloc_drm_bo_t *writer = root->write_bo;
+
+				if (state == -1 &&
+				    gralloc_drm_bo_update_generation(writer,
+						    root->write_layer,
+						    root->write_y, root->write_h))
+					gralloc_drm_bo_add_damage(writer,
+							root->write_x,
+							root->write_y,
+							root->write_w,
+							root->write_h);
+				gralloc_drm_bo_unmap_locked(root);
+				/* the writer is done with the whole frame */
+				if (state == -1 && writer->meta)
+					gralloc_drm_bo_publish(writer,
+							writer->meta->height);
+				root->write_bo = NULL;
+				break;
+			}
+		}
+		else {
+			break;
+		}
+	}
 
-	bo->lock_count--;
-	if (!bo->lock_count)
-		bo->locked_for = 0;
+	pthread_mutex_unlock(&root->lock_mutex);
 }
@@ -27,6 +27,8 @@
 #include <hardware/gralloc.h>
 #include <system/graphics.h>
 
+#include "gralloc_drm_formats.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,21 +40,278 @@ struct gralloc_drm_bo_t;
 
 enum {
 	GRALLOC_MODULE_PERFORM_GET_DRM_FD                = 0x80000002,
+	/*
+	 * (int num_planes, const int *fds, uint32_t width, uint32_t height,
+	 *  int format, int usage, const uint32_t *offsets,
+	 *  const uint32_t *pitches, uint64_t modifier,
+	 *  buffer_handle_t *handle)
+	 *
+	 * Wrap an existing dma-buf in a buffer handle.  All plane fds must
+	 * refer to the same dma-buf; before linux 5.3 that means the same
+	 * fd.  There must be as many planes as the format has, and they
+	 * must fit in the dma-buf.  The handle is freed with
+	 * GRALLOC_MODULE_PERFORM_DESTROY_BUFFER.
+	 */
+	GRALLOC_MODULE_PERFORM_IMPORT_DMABUF             = 0x80000003,
+	/*
+	 * (uint32_t width, uint32_t height, int format, int usage,
+	 *  int layer_count, buffer_handle_t *handle, int *stride)
+	 *
+	 * Allocate an array of layer_count images in a single bo.
+	 */
+	GRALLOC_MODULE_PERFORM_CREATE_LAYERED_BUFFER     = 0x80000004,
+	/*
+	 * (buffer_handle_t handle, int *layer_count, int *layer_stride)
+	 */
+	GRALLOC_MODULE_PERFORM_GET_LAYER_LAYOUT          = 0x80000005,
+	/*
+	 * (buffer_handle_t handle, int usage, int layer,
+	 *  int x, int y, int w, int h, void **addr)
+	 *
+	 * Like lock(), but addr points at the given layer.  Unlock with
+	 * unlock().
+	 */
+	GRALLOC_MODULE_PERFORM_LOCK_LAYER                = 0x80000006,
+	/*
+	 * (buffer_handle_t parent, int x, int y, int w, int h,
+	 *  buffer_handle_t *handle)
+	 *
+	 * Create a handle for a sub-rectangle of parent.  It shares the bo
+	 * and stride of parent and keeps it alive.  Free it with
+	 * GRALLOC_MODULE_PERFORM_DESTROY_BUFFER.
+	 */
+	GRALLOC_MODULE_PERFORM_CREATE_SUBRECT            = 0x80000007,
+	/*
+	 * (buffer_handle_t handle, int usage, int flags,
+	 *  int x, int y, int w, int h, void **addr)
+	 *
+	 * Like lock(), with GRALLOC_DRM_LOCK_* flags.  Unlock with
+	 * unlock().  Concurrent readers share the mapping made for the
+	 * first of them, flags included.
+	 */
+	GRALLOC_MODULE_PERFORM_LOCK_FLAGS                = 0x80000008,
+	/*
+	 * (buffer_handle_t handle, int y, int h, int *seq)
+	 *
+	 * Publish rows y to y + h of a buffer locked for writing, top to
+	 * bottom, so that consumers can start before unlock().  Only the
+	 * published band is flushed.  seq receives the publish sequence
+	 * number.  Unlock publishes the whole frame.
+	 *
+	 * This and the ops up to GRALLOC_MODULE_PERFORM_GET_DAMAGE need a
+	 * buffer allocated with GRALLOC_DRM_USAGE_METADATA, and fail with
+	 * -ENOSYS otherwise.
+	 */
+	GRALLOC_MODULE_PERFORM_PUBLISH_ROWS              = 0x80000009,
+	/*
+	 * (buffer_handle_t handle, int *rows, int *seq)
+	 *
+	 * Query the published rows of the frame being written, and the
+	 * sequence number of the last publish.
+	 */
+	GRALLOC_MODULE_PERFORM_GET_PUBLISHED_ROWS        = 0x8000000A,
+	/*
+	 * (buffer_handle_t handle, int rows, int timeout_ms)
+	 *
+	 * Wait until rows rows are published, or fail with -ETIMEDOUT.  A
+	 * negative timeout waits forever.
+	 */
+	GRALLOC_MODULE_PERFORM_WAIT_ROWS                 = 0x8000000B,
+	/*
+	 * (buffer_handle_t handle)
+	 *
+	 * Declare that the GPU or another device wrote to the buffer.
+	 */
+	GRALLOC_MODULE_PERFORM_MARK_WRITTEN              = 0x8000000C,
+	/*
+	 * (buffer_handle_t handle, int *generation)
+	 *
+	 * Query the content generation of the buffer.  It changes on every
+	 * write unlock and GRALLOC_MODULE_PERFORM_MARK_WRITTEN, so a
+	 * consumer can skip a buffer whose generation it has seen.  With
+	 * the gralloc.drm.content_hash property set, rewriting the same
+	 * rows with the same content keeps the generation.
+	 */
+	GRALLOC_MODULE_PERFORM_GET_GENERATION            = 0x8000000D,
+	/*
+	 * (buffer_handle_t handle, int *count, int *rects, int max)
+	 *
+	 * Fetch and clear the regions written since the last fetch, as up
+	 * to max x, y, w, h rectangles.  If there are more, their bounding
+	 * box is returned.  CPU write locks add their rectangle and
+	 * GRALLOC_MODULE_PERFORM_MARK_WRITTEN the whole buffer.  A
+	 * sub-rectangle shares the damage of the buffer it aliases, in the
+	 * coordinates of that buffer.
+	 */
+	GRALLOC_MODULE_PERFORM_GET_DAMAGE                = 0x8000000E,
+	/*
+	 * (int fd, int flags)
+	 *
+	 * Write every buffer allocated by this process, its parameters and
+	 * its contents as the CPU sees them, to fd.  Sub-rectangles and
+	 * imported buffers are left to their owners.
+	 */
+	GRALLOC_MODULE_PERFORM_SNAPSHOT                  = 0x8000000F,
+	/*
+	 * (int fd, buffer_handle_t *handles, int max, int *count)
+	 *
+	 * Reallocate the buffers of a snapshot read from fd and fill them.
+	 * Each gets the stride it had when saved, or the restore fails.
+	 * Their content generation, damage and published rows are not
+	 * saved and start over.
+	 */
+	GRALLOC_MODULE_PERFORM_RESTORE                   = 0x80000010,
+	/*
+	 * (buffer_handle_t handle, buffer_handle_t *copy)
+	 *
+	 * Return a copy of a handle to send to another process.  The copy
+	 * owns its fds; free it with native_handle_close() and
+	 * native_handle_delete() once sent.  With the
+	 * gralloc.drm.deferred_export property set, the buffers of this
+	 * process, those from alloc_device_t::alloc included, are kept
+	 * without a dma-buf fd, and their handles must be sent through
+	 * this op.  It exports a dma-buf for the copy, which the last few
+	 * exports share.
+	 */
+	GRALLOC_MODULE_PERFORM_EXPORT                    = 0x80000011,
+	/*
+	 * (buffer_handle_t handle, int *compatible)
+	 *
+	 * Query whether a display plane accepts the format, modifier and
+	 * size of the buffer, so that it can be scanned out without a GPU
+	 * composition pass.  Fails with -ENODEV when the display is unknown,
+	 * as it is until GRALLOC_MODULE_PERFORM_SET_DISPLAY_FD.
+	 */
+	GRALLOC_MODULE_PERFORM_IS_SCANOUT_COMPATIBLE     = 0x80000012,
+	/*
+	 * (int fd)
+	 *
+	 * Give gralloc the KMS fd of the compositor.  The display planes are
+	 * queried on it, without changing its client caps, for the scanout
+	 * allocations that follow; before it is given, those are allocated
+	 * without plane constraints.  With the gralloc.drm.prewarm property
+	 * set, new HW_FB and cursor buffers are given a framebuffer on fd
+	 * and bound for the display in the background.  The fd can be set
+	 * once and must outlive the buffers.
+	 */
+	GRALLOC_MODULE_PERFORM_SET_DISPLAY_FD            = 0x80000013,
+	/*
+	 * (buffer_handle_t handle, uint32_t *fb_id)
+	 *
+	 * Return the framebuffer gralloc added for the buffer on the fd of
+	 * GRALLOC_MODULE_PERFORM_SET_DISPLAY_FD, or 0.  It is removed when
+	 * the buffer is freed.
+	 */
+	GRALLOC_MODULE_PERFORM_GET_FB                    = 0x80000014,
+	/*
+	 * (void)
+	 *
+	 * With the gralloc.drm.deferred_free property set, freed buffers
+	 * are destroyed in batches by a background thread.  Destroy those
+	 * still waiting now, e.g. before trimming memory.
+	 */
+	GRALLOC_MODULE_PERFORM_FLUSH_FREES               = 0x80000015,
+	/*
+	 * (int fd)
+	 *
+	 * Write the flight recorder, the last buffer events of every thread,
+	 * to fd.  gralloc_drm_trace_decode prints the file as a timeline.
+	 */
+	GRALLOC_MODULE_PERFORM_DUMP_RECORDER             = 0x80000016,
+	/*
+	 * (buffer_handle_t handle, int layer, uint32_t pitches[4],
+	 *  uint32_t offsets[4], uint32_t handles[4])
+	 *
+	 * Like the layout the composer gets from resolve_format, with the
+	 * offsets pointing at the given layer.
+	 */
+	GRALLOC_MODULE_PERFORM_RESOLVE_FORMAT_LAYER      = 0x80000017,
 };
 
+/* flags of GRALLOC_MODULE_PERFORM_SNAPSHOT */
+#define GRALLOC_DRM_SNAPSHOT_COMPRESS (1 << 0) /* LZ4, when built in */
+
+/* damage is kept as at most this many rectangles */
+#define GRALLOC_DRM_MAX_DAMAGE_RECTS 8
+
+enum {
+	/* fail with -EBUSY instead of waiting for the GPU */
+	GRALLOC_DRM_LOCK_TRY                             = 1 << 0,
+	/* do not wait for the GPU at all; the caller synchronizes */
+	GRALLOC_DRM_LOCK_UNSYNCHRONIZED                  = 1 << 1,
+	/*
+	 * populate the page tables of a fresh mapping up front; implied
+	 * when the region covers at least 3/4 of the buffer
+	 */
+	GRALLOC_DRM_LOCK_PREFAULT                        = 1 << 2,
+	/*
+	 * read only: return a cached copy of the locked rows instead of
+	 * the mapping, which may be write-combined or uncached
+	 */
+	GRALLOC_DRM_LOCK_STAGED                          = 1 << 3,
+};
+
+/*
+ * Usage for single-buffered rendering, such as stylus ink.  The buffer is
+ * allocated like a framebuffer in memory coherent with scanout and stays
+ * mapped for its lifetime; lock and unlock do no work.
+ */
+#define GRALLOC_DRM_USAGE_FRONT_BUFFER GRALLOC_USAGE_PRIVATE_0
+
+/*
+ * Usage for buffers whose rows are published while written and whose
+ * content generation and damage are tracked.  These live in metadata
+ * shared by every process using the buffer, at one more fd per handle.
+ */
+#define GRALLOC_DRM_USAGE_METADATA GRALLOC_USAGE_PRIVATE_1
+
+/* usages for which buffers are laid out for the display planes */
+#define GRALLOC_DRM_USAGE_SCANOUT (GRALLOC_USAGE_HW_COMPOSER | \
+		GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER)
+
+/* sub-rectangles must start at this byte alignment within their bo */
+#define GRALLOC_DRM_SUBRECT_ALIGN 64
+
 struct gralloc_drm_t *gralloc_drm_create(void);
 void gralloc_drm_destroy(struct gralloc_drm_t *drm);
 
 int gralloc_drm_get_fd(struct gralloc_drm_t *drm);
+void gralloc_drm_flush_frees(struct gralloc_drm_t *drm);
+
+/*
+ * Packed formats store `pixels' pixels in `bytes' bytes.  Their geometry is
+ * converted to bytes by gralloc_drm_align_geometry() and their bpp is 1.
+ */
+static inline int gralloc_drm_get_packing(int format, int *pixels, int *bytes)
+{
+	switch (format) {
+	case HAL_PIXEL_FORMAT_RAW10:
+		*pixels = 4;
+		*bytes = 5;
+		return 1;
+	case HAL_PIXEL_FORMAT_RAW12:
+		*pixels = 2;
+		*bytes = 3;
+		return 1;
+	default:
+		*pixels = 1;
+		*bytes = 1;
+		return 0;
+	}
+}
 
 static inline int gralloc_drm_get_bpp(int format)
 {
 	int bpp;
 
 	switch (format) {
+	case HAL_PIXEL_FORMAT_RGBA_FP16:
+		bpp = 8;
+		break;
 	case HAL_PIXEL_FORMAT_RGBA_8888:
 	case HAL_PIXEL_FORMAT_RGBX_8888:
 	case HAL_PIXEL_FORMAT_BGRA_8888:
+	case HAL_PIXEL_FORMAT_RGBA_1010102:
 		bpp = 4;
 		break;
 	case HAL_PIXEL_FORMAT_RGB_888:
@@ -60,6 +319,11 @@ static inline int gralloc_drm_get_bpp(int format)
 		break;
 	case HAL_PIXEL_FORMAT_RGB_565:
 	case HAL_PIXEL_FORMAT_YCbCr_422_I:
+	case HAL_PIXEL_FORMAT_RAW16:
+	case HAL_PIXEL_FORMAT_Y16:
+	/* planar; only Y is considered */
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
 		bpp = 2;
 		break;
 	/* planar; only Y is considered */
@@ -67,6 +331,17 @@ static inline int gralloc_drm_get_bpp(int format)
 	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
 	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_Y8:
+		bpp = 1;
+		break;
+	/* packed; the geometry is in bytes */
+	case HAL_PIXEL_FORMAT_RAW10:
+	case HAL_PIXEL_FORMAT_RAW12:
+		bpp = 1;
+		break;
+	/* 1D; the width is the size in bytes */
+	case HAL_PIXEL_FORMAT_BLOB:
 		bpp = 1;
 		break;
 	default:
@@ -80,6 +355,7 @@ static inline int gralloc_drm_get_bpp(int format)
 static inline void gralloc_drm_align_geometry(int format, int *width, int *height)
 {
 	int align_w = 1, align_h = 1, extra_height_div = 0;
+	int pixels, bytes;
 
 	switch (format) {
 	case HAL_PIXEL_FORMAT_YV12:
@@ -93,6 +369,9 @@ static inline void gralloc_drm_align_geometry(int format, int *width, int *heigh
 		break;
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
 	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
 		align_w = 2;
 		align_h = 2;
 		extra_height_div = 2;
@@ -100,6 +379,20 @@ static inline void gralloc_drm_align_geometry(int format, int *width, int *heigh
 	case HAL_PIXEL_FORMAT_YCbCr_422_I:
 		align_w = 2;
 		break;
+	/* camera formats; rows are multiples of 16 pixels */
+	case HAL_PIXEL_FORMAT_Y8:
+	case HAL_PIXEL_FORMAT_Y16:
+		align_w = 16;
+		break;
+	case HAL_PIXEL_FORMAT_RAW16:
+		align_w = 16;
+		align_h = 2;
+		break;
+	case HAL_PIXEL_FORMAT_RAW10:
+	case HAL_PIXEL_FORMAT_RAW12:
+		align_w = 4;
+		align_h = 2;
+		break;
 	}
 
 	*width = ALIGN(*width, align_w);
@@ -107,24 +400,57 @@ static inline void gralloc_drm_align_geometry(int format, int *width, int *heigh
 
 	if (extra_height_div)
 		*height += *height / extra_height_div;
+
+	if (gralloc_drm_get_packing(format, &pixels, &bytes))
+		*width = *width / pixels * bytes;
 }
 
 int gralloc_drm_handle_register(buffer_handle_t handle, struct gralloc_drm_t *drm);
 int gralloc_drm_handle_unregister(buffer_handle_t handle);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_create(struct gralloc_drm_t *drm, int width, int height, int format, int usage);
+struct gralloc_drm_bo_t *gralloc_drm_bo_create_layered(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage, int layer_count);
+struct gralloc_drm_bo_t *gralloc_drm_bo_import(struct gralloc_drm_t *drm,
+		int width, int height, int format, int usage,
+		int num_planes, const int *fds, const uint32_t *offsets,
+		const uint32_t *pitches, uint64_t modifier);
+struct gralloc_drm_bo_t *gralloc_drm_bo_create_subrect(struct gralloc_drm_bo_t *parent,
+		int x, int y, int width, int height);
+void gralloc_drm_bo_incref(struct gralloc_drm_bo_t *bo);
 void gralloc_drm_bo_decref(struct gralloc_drm_bo_t *bo);
 
 struct gralloc_drm_bo_t *gralloc_drm_bo_from_handle(buffer_handle_t handle);
 buffer_handle_t gralloc_drm_bo_get_handle(struct gralloc_drm_bo_t *bo, int *stride);
+int gralloc_drm_bo_export(struct gralloc_drm_bo_t *bo, buffer_handle_t *copy);
+int gralloc_drm_bo_is_scanout_compatible(struct gralloc_drm_bo_t *bo, int *compatible);
+int gralloc_drm_set_display_fd(struct gralloc_drm_t *drm, int fd);
+int gralloc_drm_bo_get_fb(struct gralloc_drm_bo_t *bo, uint32_t *fb_id);
 #ifdef USE_NAME
 int gralloc_drm_get_gem_handle(buffer_handle_t handle);
 #endif
 void gralloc_drm_resolve_format(buffer_handle_t _handle, uint32_t *pitches, uint32_t *offsets, uint32_t *handles);
+void gralloc_drm_resolve_format_layer(buffer_handle_t _handle, int layer,
+		uint32_t *pitches, uint32_t *offsets, uint32_t *handles);
 unsigned int planes_for_format(struct gralloc_drm_t *drm, int hal_format);
 
-int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo, int x, int y, int w, int h, int enable_write, void **addr);
+int gralloc_drm_bo_lock(struct gralloc_drm_bo_t *bo, int usage, int x, int y, int w, int h, void **addr);
+int gralloc_drm_bo_lock_flags(struct gralloc_drm_bo_t *bo, int usage, int flags,
+		int x, int y, int w, int h, void **addr);
+int gralloc_drm_bo_lock_layer(struct gralloc_drm_bo_t *bo, int usage, int layer,
+		int x, int y, int w, int h, void **addr);
 void gralloc_drm_bo_unlock(struct gralloc_drm_bo_t *bo);
+int gralloc_drm_bo_publish_rows(struct gralloc_drm_bo_t *bo, int y, int h, int *seq);
+int gralloc_drm_bo_get_published_rows(struct gralloc_drm_bo_t *bo, int *rows, int *seq);
+int gralloc_drm_bo_wait_rows(struct gralloc_drm_bo_t *bo, int rows, int timeout_ms);
+int gralloc_drm_bo_mark_written(struct gralloc_drm_bo_t *bo);
+int gralloc_drm_bo_get_generation(struct gralloc_drm_bo_t *bo, int *generation);
+int gralloc_drm_bo_get_damage(struct gralloc_drm_bo_t *bo, int *count, int *rects, int max);
+
+int gralloc_drm_snapshot(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t **bos, int count, int fd, int flags);
+int gralloc_drm_restore(struct gralloc_drm_t *drm, int fd,
+		struct gralloc_drm_bo_t **bos, int max, int *count);
 
 #ifdef __cplusplus
 }
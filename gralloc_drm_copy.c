@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-COPY"
+
+#include <cutils/log.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <smmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+/* do not bother other threads for less than this */
+#define COPY_MIN_CHUNK (1 << 20)
+#define COPY_MAX_THREADS 4
+
+#if defined(__i386__) || defined(__x86_64__)
+
+/*
+ * MOVNTDQA fetches whole lines of write-combined memory into the
+ * streaming load buffers instead of doing one uncached read per load.
+ */
+__attribute__((target("sse4.1")))
+static void copy_stream_sse41(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	while (size >= 64) {
+		__m128i a = _mm_stream_load_si128((__m128i *) (src + 0));
+		__m128i b = _mm_stream_load_si128((__m128i *) (src + 16));
+		__m128i c = _mm_stream_load_si128((__m128i *) (src + 32));
+		__m128i d = _mm_stream_load_si128((__m128i *) (src + 48));
+
+		_mm_store_si128((__m128i *) (dst + 0), a);
+		_mm_store_si128((__m128i *) (dst + 16), b);
+		_mm_store_si128((__m128i *) (dst + 32), c);
+		_mm_store_si128((__m128i *) (dst + 48), d);
+
+		src += 64;
+		dst += 64;
+		size -= 64;
+	}
+
+	if (size)
+		memcpy(dst, src, size);
+}
+
+static void copy_stream(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	if (__builtin_cpu_supports("sse4.1") &&
+	    !((uintptr_t) src & 15) && !((uintptr_t) dst & 15))
+		copy_stream_sse41(dst, src, size);
+	else
+		memcpy(dst, src, size);
+}
+
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+/*
+ * There is no streaming load on ARM; wide loads and a streaming prefetch
+ * hint keep uncached reads in flight instead.
+ */
+static void copy_stream(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	while (size >= 64) {
+		uint8x16_t a, b, c, d;
+
+		__builtin_prefetch(src + 256, 0, 0);
+		a = vld1q_u8(src + 0);
+		b = vld1q_u8(src + 16);
+		c = vld1q_u8(src + 32);
+		d = vld1q_u8(src + 48);
+		vst1q_u8(dst + 0, a);
+		vst1q_u8(dst + 16, b);
+		vst1q_u8(dst + 32, c);
+		vst1q_u8(dst + 48, d);
+
+		src += 64;
+		dst += 64;
+		size -= 64;
+	}
+
+	if (size)
+		memcpy(dst, src, size);
+}
+
+#else
+
+static void copy_stream(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+#endif
+
+/* batches chunks handed to the copy workers */
+struct copy_batch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int pending;
+};
+
+struct copy_chunk {
+	uint8_t *dst;
+	const uint8_t *src;
+	size_t size;
+	struct copy_batch *batch;
+};
+
+/* started on the first large copy and kept for the life of the process */
+static struct gralloc_drm_worker_t *copy_workers[COPY_MAX_THREADS - 1];
+static pthread_once_t copy_once = PTHREAD_ONCE_INIT;
+
+static void copy_init_workers(void)
+{
+	int i;
+
+	for (i = 0; i < COPY_MAX_THREADS - 1; i++) {
+		copy_workers[i] = gralloc_drm_worker_create(0);
+		if (!copy_workers[i])
+			ALOGW("failed to start copy worker %d", i);
+	}
+}
+
+static void copy_chunk_job(void *arg)
+{
+	struct copy_chunk *chunk = (struct copy_chunk *) arg;
+	struct copy_batch *batch = chunk->batch;
+
+	copy_stream(chunk->dst, chunk->src, chunk->size);
+
+	pthread_mutex_lock(&batch->mutex);
+	if (!--batch->pending)
+		pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+/*
+ * Copy from write-combined or uncached memory to cached memory.  Large
+ * copies are split across worker threads, as a single core cannot keep
+ * enough uncached reads in flight to saturate the bus.
+ */
+void gralloc_drm_copy_from_uncached(void *dst, const void *src, size_t size)
+{
+	struct copy_chunk chunks[COPY_MAX_THREADS];
+	struct copy_batch batch;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t chunk_size;
+	int count, i;
+
+	count = size / COPY_MIN_CHUNK;
+	if (count > cpus)
+		count = cpus;
+	if (count > COPY_MAX_THREADS)
+		count = COPY_MAX_THREADS;
+	if (count <= 1) {
+		copy_stream((uint8_t *) dst, (const uint8_t *) src, size);
+		return;
+	}
+
+	pthread_once(&copy_once, copy_init_workers);
+
+	/* keep chunk boundaries cache line aligned */
+	chunk_size = ((size / count) + 63) & ~((size_t) 63);
+
+	pthread_mutex_init(&batch.mutex, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	batch.pending = 0;
+
+	for (i = 0; i < count; i++) {
+		size_t offset = chunk_size * i;
+
+		chunks[i].dst = (uint8_t *) dst + offset;
+		chunks[i].src = (const uint8_t *) src + offset;
+		chunks[i].size = (i == count - 1) ? size - offset : chunk_size;
+		chunks[i].batch = &batch;
+	}
+
+	/* the calling thread copies the first chunk and any not queued */
+	for (i = 1; i < count; i++) {
+		pthread_mutex_lock(&batch.mutex);
+		batch.pending++;
+		pthread_mutex_unlock(&batch.mutex);
+
+		if (!copy_workers[i - 1] ||
+		    gralloc_drm_worker_queue(copy_workers[i - 1],
+				    copy_chunk_job, &chunks[i]))
+			copy_chunk_job(&chunks[i]);
+	}
+
+	copy_stream(chunks[0].dst, chunks[0].src, chunks[0].size);
+
+	pthread_mutex_lock(&batch.mutex);
+	while (batch.pending)
+		pthread_cond_wait(&batch.cond, &batch.mutex);
+	pthread_mutex_unlock(&batch.mutex);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.mutex);
+}
@@ -29,6 +29,9 @@ extern "C" {
 enum {
 
 	HAL_PIXEL_FORMAT_DRM_NV12 = 0x102,
+	/* 10 and 16 bit 4:2:0, one 16 bit sample per component */
+	HAL_PIXEL_FORMAT_DRM_P010 = 0x103,
+	HAL_PIXEL_FORMAT_DRM_P016 = 0x104,
 };
 
 #ifdef __cplusplus
@@ -40,6 +40,11 @@ struct gralloc_drm_handle_t {
 
 	/* file descriptors */
 	int prime_fd;
+	/*
+	 * shared metadata, see struct gralloc_drm_meta_t; without it, -1
+	 * and counted as an integer
+	 */
+	int meta_fd;
 
 	/* integers */
 	int magic;
@@ -52,22 +57,45 @@ struct gralloc_drm_handle_t {
         int name;   /* the name of the bo */
 #endif
 	int stride; /* the stride in bytes */
+	int flags;  /* GRALLOC_DRM_HANDLE_FLAG_* */
+
+	/* explicit plane layout, used instead of the format's when non-zero */
+	int num_planes;
+	int offsets[4];
+	int pitches[4];
+
+	int layer_count;  /* layers of the image, all in one bo */
+	int layer_stride; /* bytes from one layer to the next */
+	int offset;       /* bytes from the start of the bo to the image */
 
 	struct gralloc_drm_bo_t *data; /* pointer to struct gralloc_drm_bo_t */
 
 	// FIXME: the attributes below should be out-of-line
 	uint64_t unknown __attribute__((aligned(8)));
+	uint64_t modifier __attribute__((aligned(8))); /* DRM format modifier */
 	int data_owner; /* owner of data (for validation) */
 };
 #define GRALLOC_DRM_HANDLE_MAGIC 0x12345678
+
+/* the bo wraps a dma-buf that was not allocated by gralloc */
+#define GRALLOC_DRM_HANDLE_FLAG_EXTERNAL	(1 << 0)
+/* the handle aliases a sub-rectangle of another buffer, at offset */
+#define GRALLOC_DRM_HANDLE_FLAG_SUBRECT		(1 << 1)
+/* in the allocating process, prime_fd is only valid after an export */
+#define GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT	(1 << 2)
+
 #ifdef USE_NAME
  #define GRALLOC_DRM_HANDLE_NUM_FDS 0
+ #define GRALLOC_DRM_HANDLE_NUM_META_FDS 0
 #else
 #define GRALLOC_DRM_HANDLE_NUM_FDS 1
+/* a handle with metadata counts meta_fd as one more fd */
+#define GRALLOC_DRM_HANDLE_NUM_META_FDS 1
 #endif
+#define GRALLOC_DRM_HANDLE_NUM_DATA						\
+	((sizeof(struct gralloc_drm_handle_t) - sizeof(native_handle_t))/sizeof(int))
 #define GRALLOC_DRM_HANDLE_NUM_INTS (						\
-	((sizeof(struct gralloc_drm_handle_t) - sizeof(native_handle_t))/sizeof(int))	\
-	 - GRALLOC_DRM_HANDLE_NUM_FDS)
+	GRALLOC_DRM_HANDLE_NUM_DATA - GRALLOC_DRM_HANDLE_NUM_FDS)
 
 static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _handle)
 {
@@ -75,8 +103,13 @@ static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _h
 		(struct gralloc_drm_handle_t *) _handle;
 
 	if (handle && (handle->base.version != sizeof(handle->base) ||
-	               handle->base.numInts != GRALLOC_DRM_HANDLE_NUM_INTS ||
-	               handle->base.numFds != GRALLOC_DRM_HANDLE_NUM_FDS ||
+	               handle->base.numFds + handle->base.numInts !=
+	               (int) GRALLOC_DRM_HANDLE_NUM_DATA ||
+	               handle->base.numFds < GRALLOC_DRM_HANDLE_NUM_FDS ||
+	               handle->base.numFds > GRALLOC_DRM_HANDLE_NUM_FDS +
+	               GRALLOC_DRM_HANDLE_NUM_META_FDS ||
+	               (handle->base.numFds == GRALLOC_DRM_HANDLE_NUM_FDS &&
+	                handle->meta_fd >= 0) ||
 	               handle->magic != GRALLOC_DRM_HANDLE_MAGIC)) {
 		ALOGE("invalid handle: version=%d, numInts=%d, numFds=%d, magic=%x",
 			handle->base.version, handle->base.numInts,
@@ -87,6 +120,29 @@ static inline struct gralloc_drm_handle_t *gralloc_drm_handle(buffer_handle_t _h
 	return handle;
 }
 
+/*
+ * Fill in the explicit plane layout of a handle.  Return 0 when the layout
+ * is to be derived from the format instead.
+ */
+static inline int gralloc_drm_handle_get_layout(const struct gralloc_drm_handle_t *handle,
+		uint32_t gem_handle, uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
+{
+	int i;
+
+	if (!handle->num_planes)
+		return 0;
+
+	for (i = 0; i < 4; i++) {
+		int valid = (i < handle->num_planes);
+
+		pitches[i] = (valid) ? handle->pitches[i] : 0;
+		offsets[i] = (valid) ? handle->offsets[i] : 0;
+		handles[i] = (valid) ? gem_handle : 0;
+	}
+
+	return 1;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+/*
+ * The hash only needs to tell whether a region changed, not resist
+ * attacks, so each 64-bit lane is a CRC32C where the CPU has it.  Four
+ * independent lanes hide the latency of the CRC instruction.
+ */
+
+static uint64_t hash_finish(uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+		const uint8_t *tail, size_t size)
+{
+	uint64_t h = a;
+	size_t i;
+
+	h = (h ^ b) * 0x9e3779b97f4a7c15ull;
+	h = (h ^ c) * 0x9e3779b97f4a7c15ull;
+	h = (h ^ d) * 0x9e3779b97f4a7c15ull;
+
+	/* FNV-1a over the bytes that do not fill a block */
+	for (i = 0; i < size; i++) {
+		h ^= tail[i];
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint64_t hash_crc32c(uint64_t seed, const uint8_t *p, size_t size)
+{
+	uint64_t a = (uint32_t) seed, b = seed >> 32, c = ~a, d = ~b;
+
+	while (size >= 32) {
+		uint64_t v[4];
+
+		memcpy(v, p, sizeof(v));
+		a = _mm_crc32_u64(a, v[0]);
+		b = _mm_crc32_u64(b, v[1]);
+		c = _mm_crc32_u64(c, v[2]);
+		d = _mm_crc32_u64(d, v[3]);
+
+		p += 32;
+		size -= 32;
+	}
+
+	return hash_finish(a, b, c, d, p, size);
+}
+
+static int has_crc32c(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc")))
+static uint64_t hash_crc32c(uint64_t seed, const uint8_t *p, size_t size)
+{
+	uint64_t a = (uint32_t) seed, b = seed >> 32, c = ~a, d = ~b;
+
+	while (size >= 32) {
+		uint64_t v[4];
+
+		memcpy(v, p, sizeof(v));
+		a = __crc32cd((uint32_t) a, v[0]);
+		b = __crc32cd((uint32_t) b, v[1]);
+		c = __crc32cd((uint32_t) c, v[2]);
+		d = __crc32cd((uint32_t) d, v[3]);
+
+		p += 32;
+		size -= 32;
+	}
+
+	return hash_finish(a, b, c, d, p, size);
+}
+
+static int has_crc32c(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+
+#else
+
+static uint64_t hash_crc32c(uint64_t seed, const uint8_t *p, size_t size)
+{
+	return 0;
+}
+
+static int has_crc32c(void)
+{
+	return 0;
+}
+
+#endif
+
+/*
+ * Hash size bytes at data, continuing from seed.
+ */
+uint64_t gralloc_drm_hash(uint64_t seed, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	uint64_t a, b, c, d;
+
+	if (has_crc32c())
+		return hash_crc32c(seed, p, size);
+
+	a = seed;
+	b = ~seed;
+	c = seed * 0x9e3779b97f4a7c15ull;
+	d = ~c;
+	while (size >= 32) {
+		uint64_t v[4];
+
+		memcpy(v, p, sizeof(v));
+		a = (a ^ v[0]) * 0x100000001b3ull;
+		b = (b ^ v[1]) * 0x100000001b3ull;
+		c = (c ^ v[2]) * 0x100000001b3ull;
+		d = (d ^ v[3]) * 0x100000001b3ull;
+
+		p += 32;
+		size -= 32;
+	}
+
+	return hash_finish(a, b, c, d, p, size);
+}
@@ -43,6 +43,13 @@
 #include "gralloc_drm_priv.h"
 #include "util.h"
 
+#ifndef DRM_FORMAT_P010
+#define DRM_FORMAT_P010 fourcc_code('P', '0', '1', '0')
+#endif
+#ifndef DRM_FORMAT_P016
+#define DRM_FORMAT_P016 fourcc_code('P', '0', '1', '6')
+#endif
+
 #define DRM_CLOEXEC O_CLOEXEC
 #ifndef DRM_RDWR
 #define DRM_RDWR O_RDWR
@@ -54,6 +61,7 @@ struct intel_info {
 	int fd;
 	drm_intel_bufmgr *bufmgr;
 	int gen;
+	int has_llc;
 	uint32_t cursor_width;
 	uint32_t cursor_height;
 };
@@ -62,15 +70,107 @@ struct intel_buffer {
 	struct gralloc_drm_bo_t base;
 	drm_intel_bo *ibo;
 	uint32_t tiling;
+	int gtt_mapped;
+};
+
+#ifndef I915_PARAM_HAS_LLC
+#define I915_PARAM_HAS_LLC 17
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define INTEL_USAGE_CAMERA \
+	(GRALLOC_USAGE_HW_CAMERA_WRITE | GRALLOC_USAGE_HW_CAMERA_READ)
+#define INTEL_USAGE_YUV420_FETCH \
+	(GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_COMPOSER | \
+	 GRALLOC_USAGE_HW_VIDEO_ENCODER)
+
+static const struct gralloc_drm_codec_constraint_t intel_codec_constraints[] = {
+	/* the media engine works on 16x16 macroblocks */
+	{ 0, GRALLOC_USAGE_HW_VIDEO_ENCODER, 16, 16, 0, 0 },
+	/* sampler, display and media engines fetch YUV420 in 128 byte rows */
+	{ HAL_PIXEL_FORMAT_YV12, INTEL_USAGE_YUV420_FETCH, 128, 1, 0, 0 },
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888, INTEL_USAGE_YUV420_FETCH, 128, 1, 0, 0 },
+	/* the ISP writes lines of 16 pixels and pairs of rows */
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888, INTEL_USAGE_CAMERA, 16, 2, 0, 0 },
+	{ HAL_PIXEL_FORMAT_YCrCb_420_SP, INTEL_USAGE_CAMERA, 16, 2, 0, 0 },
 };
 
-static void calculate_aligned_geometry(uint32_t fourcc_format, int usage,
+/*
+ * Return the height of the first plane, which is where the chroma planes
+ * of planar formats start.
+ */
+static uint32_t calculate_plane_height(const struct gralloc_drm_handle_t *handle)
+{
+	int width = handle->width, height = handle->height;
+
+	gralloc_drm_codec_align(intel_codec_constraints,
+			ARRAY_SIZE(intel_codec_constraints),
+			handle->format, handle->usage,
+			&width, &height, NULL, NULL);
+
+	return height;
+}
+
+/*
+ * Return the number of rows in a tile.  Planes of semi-planar formats must
+ * start on a tile row.
+ */
+static uint32_t tile_rows(uint32_t tiling)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		return 8;
+	case I915_TILING_Y:
+		return 32;
+	default:
+		return 1;
+	}
+}
+
+static int is_semi_planar(uint32_t fourcc_format)
+{
+	switch (fourcc_format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+	case DRM_FORMAT_P010:
+	case DRM_FORMAT_P016:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void calculate_aligned_geometry(int hal_format,
+		uint32_t fourcc_format, int usage, uint32_t tiling,
 		uint32_t cursor_width,
 		uint32_t cursor_height,
 		uint32_t *width,
 		uint32_t *height)
 {
 	uint32_t width_alignment = 1, height_alignment = 1, extra_height_div = 0;
+	int codec_width = *width, codec_height = *height, extra_rows;
+
+	gralloc_drm_codec_align(intel_codec_constraints,
+			ARRAY_SIZE(intel_codec_constraints),
+			hal_format, usage, &codec_width, &codec_height,
+			&extra_rows, NULL);
+	*width = codec_width;
+	*height = codec_height;
+
+	switch (hal_format) {
+	case HAL_PIXEL_FORMAT_Y8:
+	case HAL_PIXEL_FORMAT_Y16:
+	case HAL_PIXEL_FORMAT_RAW16:
+	case HAL_PIXEL_FORMAT_RAW10:
+	case HAL_PIXEL_FORMAT_RAW12:
+		/* camera formats, possibly packed; use the generic layout */
+		gralloc_drm_align_geometry(hal_format, &codec_width, &codec_height);
+		*width = codec_width;
+		*height = codec_height;
+		break;
+	}
+
 	switch(fourcc_format) {
 	case DRM_FORMAT_YUV420:
 		width_alignment = 32;
@@ -86,8 +186,10 @@ static void calculate_aligned_geometry(uint32_t fourcc_format, int usage,
 		break;
 	case DRM_FORMAT_NV21:
 	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_P010:
+	case DRM_FORMAT_P016:
 		width_alignment = 2;
-		height_alignment = 2;
+		height_alignment = (tile_rows(tiling) > 2) ? tile_rows(tiling) : 2;
 		extra_height_div = 2;
 		break;
 	}
@@ -98,10 +200,12 @@ static void calculate_aligned_geometry(uint32_t fourcc_format, int usage,
 	if (extra_height_div)
 		*height += *height / extra_height_div;
 
-	if (usage & GRALLOC_USAGE_CURSOR)  {
+	if (hal_format == HAL_PIXEL_FORMAT_BLOB) {
+		/* 1D */
+	} else if (usage & GRALLOC_USAGE_CURSOR)  {
 		*width = ALIGN(*width, cursor_width);
 		*height = ALIGN(*height, cursor_height);
-	} else if (usage & GRALLOC_USAGE_HW_FB) {
+	} else if (usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER)) {
 		*width = ALIGN(*width, 64);
 	} else if (usage & GRALLOC_USAGE_HW_TEXTURE) {
 		/* see 2D texture layout of DRI drivers */
@@ -109,8 +213,7 @@ static void calculate_aligned_geometry(uint32_t fourcc_format, int usage,
 		*height = ALIGN(*height, 2);
 	}
 
-	if (fourcc_format == DRM_FORMAT_YUV420)
-		*width = ALIGN(*width, 128);
+	*height += extra_rows;
 }
 
 static void calculate_offsets(struct gralloc_drm_bo_t *bo,
@@ -122,6 +225,10 @@ static void calculate_offsets(struct gralloc_drm_bo_t *bo,
 {
 	struct intel_buffer *ib = (struct intel_buffer *) bo;
 
+	if (gralloc_drm_handle_get_layout(ib->base.handle, ib->base.fb_handle,
+				pitches, offsets, handles))
+		return;
+
 	memset(pitches, 0, 4 * sizeof(uint32_t));
 	memset(offsets, 0, 4 * sizeof(uint32_t));
 	memset(handles, 0, 4 * sizeof(uint32_t));
@@ -143,6 +250,18 @@ static void calculate_offsets(struct gralloc_drm_bo_t *bo,
 
 			handles[1] = handles[2] = handles[0];
 			break;
+		case DRM_FORMAT_NV12:
+		case DRM_FORMAT_NV21:
+		case DRM_FORMAT_P010:
+		case DRM_FORMAT_P016:
+			// interleaved chroma below Y, on a tile row of its own
+			pitches[1] = pitches[0];
+			offsets[1] = offsets[0] + pitches[0] *
+				ALIGN(height, (tile_rows(ib->tiling) > 2) ?
+						tile_rows(ib->tiling) : 2);
+
+			handles[1] = handles[0];
+			break;
 	}
 }
 
@@ -151,7 +270,7 @@ static void intel_resolve_format(struct gralloc_drm_drv_t *drv,
 		uint32_t *pitches, uint32_t *offsets, uint32_t *handles)
 {
 	uint32_t fourcc_format = get_fourcc_format_for_hal_format(bo->handle->format);
-	calculate_offsets(bo, fourcc_format, bo->handle->height,
+	calculate_offsets(bo, fourcc_format, calculate_plane_height(bo->handle),
 			pitches, offsets, handles);
 }
 
@@ -178,11 +297,12 @@ static int intel_resolve_buffer(struct gralloc_drm_drv_t *drv,
 	if (handle->usage & GRALLOC_USAGE_CURSOR)
 		hwc_bo->format = DRM_FORMAT_ARGB8888;
 
-	calculate_aligned_geometry(hwc_bo->format, handle->usage,
-				info->cursor_width, info->cursor_height,
+	calculate_aligned_geometry(handle->format, hwc_bo->format, handle->usage,
+				ib->tiling, info->cursor_width, info->cursor_height,
 				&aligned_width, &aligned_height);
 
-	calculate_offsets(handle->data, hwc_bo->format, handle->height,
+	calculate_offsets(handle->data, hwc_bo->format,
+			calculate_plane_height(handle),
 			hwc_bo->pitches, hwc_bo->offsets, hwc_bo->gem_handles);
 
 	hwc_bo->width = aligned_width;
@@ -197,9 +317,67 @@ static int intel_resolve_buffer(struct gralloc_drm_drv_t *drv,
 	return 0;
 }
 
+/*
+ * Stack the layers of a layered buffer.  Each layer starts on a tile row so
+ * that it can be addressed like a buffer of its own.
+ */
+static uint32_t calculate_layered_height(const struct gralloc_drm_handle_t *handle,
+		uint32_t height, uint32_t *layer_rows)
+{
+	*layer_rows = (handle->layer_count > 1) ?
+		ALIGN(height, tile_rows(I915_TILING_Y)) : height;
+
+	return *layer_rows * handle->layer_count;
+}
+
+static uint64_t intel_tiling_modifier(uint32_t tiling)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		return I915_FORMAT_MOD_X_TILED;
+	case I915_TILING_Y:
+		return I915_FORMAT_MOD_Y_TILED;
+	default:
+		return DRM_FORMAT_MOD_LINEAR;
+	}
+}
+
+/*
+ * Demote the tiling of a buffer meant for the display until a plane
+ * accepts it.
+ */
+static uint32_t intel_scanout_tiling(struct intel_info *info,
+		const struct gralloc_drm_handle_t *handle,
+		uint32_t fourcc_format, uint32_t tiling)
+{
+	static const uint32_t order[] = {
+		I915_TILING_Y, I915_TILING_X, I915_TILING_NONE
+	};
+	unsigned int i;
+
+	if (!info->base.scanout ||
+	    !(handle->usage & GRALLOC_DRM_USAGE_SCANOUT))
+		return tiling;
+
+	for (i = 0; i < ARRAY_SIZE(order); i++) {
+		if (order[i] != tiling)
+			continue;
+		for (; i < ARRAY_SIZE(order); i++) {
+			if (gralloc_drm_scanout_supports(info->base.scanout,
+					fourcc_format,
+					intel_tiling_modifier(order[i]),
+					handle->width, handle->height))
+				return order[i];
+		}
+	}
+
+	/* no plane takes it anyway; keep what is best for the GPU */
+	return tiling;
+}
+
 static drm_intel_bo *alloc_ibo(struct intel_info *info,
 		const struct gralloc_drm_handle_t *handle,
-		uint32_t *tiling, unsigned long *stride)
+		uint32_t *tiling, unsigned long *stride, uint32_t *layer_rows)
 {
 	drm_intel_bo *ibo;
 	const char *name;
@@ -216,10 +394,16 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 	aligned_width = handle->width;
 	aligned_height = handle->height;
 	fourcc_format = get_fourcc_format_for_hal_format(handle->format);
-	calculate_aligned_geometry(fourcc_format, handle->usage,
-				   info->cursor_width, info->cursor_height,
-				   &aligned_width, &aligned_height);
-	if (handle->usage & GRALLOC_USAGE_HW_FB || handle->usage & GRALLOC_USAGE_CURSOR) {
+	if (handle->format == HAL_PIXEL_FORMAT_BLOB) {
+		/* plain linear memory, no padding */
+		*tiling = I915_TILING_NONE;
+		*stride = handle->width;
+		*layer_rows = 1;
+
+		ibo = drm_intel_bo_alloc(info->bufmgr, "gralloc-blob",
+				handle->width, 0);
+	}
+	else if (handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER) || handle->usage & GRALLOC_USAGE_CURSOR) {
 		unsigned long max_stride;
 
 		max_stride = 32 * 1024;
@@ -232,9 +416,17 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 		    name = "gralloc-cursor";
 		} else {
 		    name = "gralloc-fb";
-		    *tiling = I915_TILING_X;
+		    *tiling = intel_scanout_tiling(info, handle,
+				    fourcc_format, I915_TILING_X);
 		}
 
+		calculate_aligned_geometry(handle->format, fourcc_format,
+					   handle->usage, *tiling,
+					   info->cursor_width, info->cursor_height,
+					   &aligned_width, &aligned_height);
+		aligned_height = calculate_layered_height(handle,
+				aligned_height, layer_rows);
+
 		flags = BO_ALLOC_FOR_RENDER;
 		*stride = aligned_width * bpp;
 		if (*stride > max_stride) {
@@ -274,9 +466,18 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 			name = "gralloc-buffer";
 		}
 
-		if (get_fourcc_format_for_hal_format(handle->format) == DRM_FORMAT_YUV420) {
+		if (fourcc_format == DRM_FORMAT_YUV420) {
 			*tiling = I915_TILING_NONE;
 			name = "gralloc-videotexture";
+		} else if (is_semi_planar(fourcc_format)) {
+			/* the media engine prefers Y-tiled NV12 and P010 */
+			if (handle->usage & (GRALLOC_USAGE_SW_READ_OFTEN |
+						GRALLOC_USAGE_SW_WRITE_OFTEN) ||
+			    info->gen < 60)
+				*tiling = I915_TILING_NONE;
+			else
+				*tiling = I915_TILING_Y;
+			name = "gralloc-video";
 		} else {
 			if (handle->usage & (GRALLOC_USAGE_SW_READ_OFTEN |
 						GRALLOC_USAGE_SW_WRITE_OFTEN))
@@ -288,6 +489,15 @@ static drm_intel_bo *alloc_ibo(struct intel_info *info,
 			else
 				*tiling = I915_TILING_NONE;
 		}
+		*tiling = intel_scanout_tiling(info, handle, fourcc_format,
+				*tiling);
+
+		calculate_aligned_geometry(handle->format, fourcc_format,
+					   handle->usage, *tiling,
+					   info->cursor_width, info->cursor_height,
+					   &aligned_width, &aligned_height);
+		aligned_height = calculate_layered_height(handle,
+				aligned_height, layer_rows);
 
 		if (handle->usage & GRALLOC_USAGE_HW_RENDER)
 			flags = BO_ALLOC_FOR_RENDER;
@@ -335,11 +545,26 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 			free(ib);
 			return NULL;
 		}
+
+		/*
+		 * External producers describe tiling with a modifier only.
+		 * The object is theirs, so take the layout from the modifier
+		 * without setting the kernel tiling of it.
+		 */
+		if (ib->tiling == I915_TILING_NONE &&
+		    (handle->flags & GRALLOC_DRM_HANDLE_FLAG_EXTERNAL)) {
+			if (handle->modifier == I915_FORMAT_MOD_X_TILED)
+				ib->tiling = I915_TILING_X;
+			else if (handle->modifier == I915_FORMAT_MOD_Y_TILED)
+				ib->tiling = I915_TILING_Y;
+		}
 	}
 	else {
 		unsigned long stride;
+		uint32_t layer_rows;
 
-		ib->ibo = alloc_ibo(info, handle, &ib->tiling, &stride);
+		ib->ibo = alloc_ibo(info, handle, &ib->tiling, &stride,
+				&layer_rows);
 		if (!ib->ibo) {
 			ALOGE("failed to allocate ibo %dx%d (format %d)",
 					handle->width,
@@ -350,14 +575,19 @@ static struct gralloc_drm_bo_t *intel_alloc(struct gralloc_drm_drv_t *drv,
 		}
 
                 handle->stride = stride;
+                handle->layer_stride = stride * layer_rows;
+		handle->modifier = intel_tiling_modifier(ib->tiling);
 #ifdef USE_NAME
                 int r = drm_intel_bo_flink(ib->ibo, (uint32_t *) &handle->name));
 #else
-
-                int r = drmPrimeHandleToFD(info->fd,
-                                           ib->ibo->handle,
-                                           DRM_CLOEXEC | DRM_RDWR,
-                                           &handle->prime_fd);
+		/* gralloc exports on demand; see intel_export_fd */
+		int r = 0;
+
+		if (!(handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT))
+			r = drmPrimeHandleToFD(info->fd,
+					       ib->ibo->handle,
+					       DRM_CLOEXEC | DRM_RDWR,
+					       &handle->prime_fd);
 #endif
                 if (r < 0) {
                     ALOGE("cannot get prime-fd for handle");
@@ -383,6 +613,16 @@ static void intel_free(struct gralloc_drm_drv_t *drv,
 	free(ib);
 }
 
+static int intel_export_fd(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int *fd)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+
+	return drmPrimeHandleToFD(info->fd, ib->ibo->handle,
+			DRM_CLOEXEC | DRM_RDWR, fd);
+}
+
 static int intel_map(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo,
 		int x, int y, int w, int h,
@@ -392,10 +632,50 @@ static int intel_map(struct gralloc_drm_drv_t *drv,
 	int err;
 
 	if (ib->tiling != I915_TILING_NONE ||
-	    (ib->base.handle->usage & GRALLOC_USAGE_HW_FB))
+	    (ib->base.handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER))) {
 		err = drm_intel_gem_bo_map_gtt(ib->ibo);
-	else
+		ib->gtt_mapped = 1;
+	}
+	else {
 		err = drm_intel_bo_map(ib->ibo, enable_write);
+		ib->gtt_mapped = 0;
+	}
+	if (!err)
+		*addr = ib->ibo->virtual;
+
+	return err;
+}
+
+static int intel_prewarm(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	unsigned long off;
+	int err;
+
+	/* faulting the GTT mapping binds the bo into the GGTT the display reads */
+	err = drm_intel_gem_bo_map_gtt(ib->ibo);
+	if (err)
+		return err;
+
+	for (off = 0; off < ib->ibo->size; off += 4096)
+		(void) ((volatile uint8_t *) ib->ibo->virtual)[off];
+	drm_intel_gem_bo_unmap_gtt(ib->ibo);
+
+	return 0;
+}
+
+static int intel_map_unsynchronized(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo,
+		int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	int err;
+
+	/* always a GTT mapping, so that no clflush is needed */
+	err = drm_intel_gem_bo_map_unsynchronized(ib->ibo);
+	ib->gtt_mapped = 1;
 	if (!err)
 		*addr = ib->ibo->virtual;
 
@@ -407,13 +687,59 @@ static void intel_unmap(struct gralloc_drm_drv_t *drv,
 {
 	struct intel_buffer *ib = (struct intel_buffer *) bo;
 
-	if (ib->tiling != I915_TILING_NONE ||
-	    (ib->base.handle->usage & GRALLOC_USAGE_HW_FB))
+	if (ib->gtt_mapped)
 		drm_intel_gem_bo_unmap_gtt(ib->ibo);
 	else
 		drm_intel_bo_unmap(ib->ibo);
 }
 
+static int intel_map_cached(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+
+	/* CPU mmaps are cached; GTT mmaps are write-combined */
+	return !ib->gtt_mapped;
+}
+
+static void intel_flush_range(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, void *addr, size_t size)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	uintptr_t p, end;
+
+	/* GTT writes only need the WC buffers drained, and LLC is coherent */
+	if (ib->gtt_mapped || info->has_llc)
+		return;
+
+	p = (uintptr_t) addr & ~((uintptr_t) 63);
+	end = (uintptr_t) addr + size;
+	for (; p < end; p += 64)
+		__builtin_ia32_clflush((const void *) p);
+	__builtin_ia32_mfence();
+}
+
+static int intel_busy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int write)
+{
+	struct intel_info *info = (struct intel_info *) drv;
+	struct intel_buffer *ib = (struct intel_buffer *) bo;
+	struct drm_i915_gem_busy busy;
+
+	memset(&busy, 0, sizeof(busy));
+	busy.handle = ib->ibo->handle;
+	if (drmIoctl(info->fd, DRM_IOCTL_I915_GEM_BUSY, &busy))
+		return drm_intel_bo_busy(ib->ibo);
+
+	/*
+	 * The low word names the engine writing the bo and the high word
+	 * the engines reading it.  Before linux 4.7 the low word is set for
+	 * any use, which keeps reads conservative there.
+	 */
+	return (write) ? busy.busy != 0 : (busy.busy & 0xffff) != 0;
+}
+
 #include "intel_chipset.h" /* for platform detection macros */
 static void gen_init(struct intel_info *info)
 {
@@ -441,6 +767,12 @@ static void gen_init(struct intel_info *info)
 		info->gen = 30;
 	}
 
+	memset(&gp, 0, sizeof(gp));
+	gp.param = I915_PARAM_HAS_LLC;
+	gp.value = &info->has_llc;
+	if (drmCommandWriteRead(info->fd, DRM_I915_GETPARAM, &gp, sizeof(gp)))
+		info->has_llc = 0;
+
 	get_preferred_cursor_attributes(info->fd,
 					&info->cursor_width,
 					&info->cursor_height);
@@ -479,6 +811,12 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd)
 	info->base.free = intel_free;
 	info->base.map = intel_map;
 	info->base.unmap = intel_unmap;
+	info->base.busy = intel_busy;
+	info->base.map_unsynchronized = intel_map_unsynchronized;
+	info->base.map_cached = intel_map_cached;
+	info->base.flush_range = intel_flush_range;
+	info->base.export_fd = intel_export_fd;
+	info->base.prewarm = intel_prewarm;
 	info->base.resolve_format = intel_resolve_format;
 	info->base.resolve_buffer = intel_resolve_buffer;
 
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-KMS"
+
+#include <cutils/log.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+static int scanout_add(struct gralloc_drm_scanout_t *scanout,
+		uint32_t format, uint64_t modifier)
+{
+	struct gralloc_drm_plane_format_t *formats;
+	int i;
+
+	for (i = 0; i < scanout->count; i++) {
+		if (scanout->formats[i].format == format &&
+		    scanout->formats[i].modifier == modifier)
+			return 0;
+	}
+
+	formats = (struct gralloc_drm_plane_format_t *) realloc(
+			scanout->formats,
+			sizeof(*formats) * (scanout->count + 1));
+	if (!formats)
+		return -ENOMEM;
+
+	formats[scanout->count].format = format;
+	formats[scanout->count].modifier = modifier;
+	scanout->formats = formats;
+	scanout->count++;
+
+	return 0;
+}
+
+/*
+ * Add the format and modifier pairs of an IN_FORMATS blob.
+ */
+static int scanout_add_blob(struct gralloc_drm_scanout_t *scanout,
+		const drmModePropertyBlobRes *blob)
+{
+	const struct drm_format_modifier_blob *header =
+		(const struct drm_format_modifier_blob *) blob->data;
+	const uint32_t *formats;
+	const struct drm_format_modifier *mods;
+	uint32_t i, j;
+	int err;
+
+	if (blob->length < sizeof(*header) ||
+	    header->formats_offset + (uint64_t) header->count_formats *
+	    sizeof(*formats) > blob->length ||
+	    header->modifiers_offset + (uint64_t) header->count_modifiers *
+	    sizeof(*mods) > blob->length)
+		return -EINVAL;
+
+	formats = (const uint32_t *)
+		((const uint8_t *) blob->data + header->formats_offset);
+	mods = (const struct drm_format_modifier *)
+		((const uint8_t *) blob->data + header->modifiers_offset);
+
+	/* each modifier covers up to 64 formats from its offset on */
+	for (i = 0; i < header->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			if (!(mods[i].formats & (1ull << j)) ||
+			    mods[i].offset + j >= header->count_formats)
+				continue;
+
+			err = scanout_add(scanout, formats[mods[i].offset + j],
+					mods[i].modifier);
+			if (err)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Add what a plane accepts.  Return 1 for a cursor plane, which is
+ * skipped, as buffers are not allocated for it.
+ */
+static int scanout_add_plane(struct gralloc_drm_scanout_t *scanout,
+		int fd, uint32_t plane_id)
+{
+	drmModePlanePtr plane;
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyBlobPtr in_formats = NULL;
+	uint32_t i;
+	int err = 0;
+
+	props = drmModeObjectGetProperties(fd, plane_id,
+			DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return -errno;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "type") &&
+		    props->prop_values[i] == DRM_PLANE_TYPE_CURSOR)
+			err = 1;
+		else if (!strcmp(prop->name, "IN_FORMATS"))
+			in_formats = drmModeGetPropertyBlob(fd,
+					(uint32_t) props->prop_values[i]);
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	if (err) {
+		if (in_formats)
+			drmModeFreePropertyBlob(in_formats);
+		return err;
+	}
+
+	if (in_formats) {
+		err = scanout_add_blob(scanout, in_formats);
+		drmModeFreePropertyBlob(in_formats);
+		return err;
+	}
+
+	/* no modifiers; the kernel infers the layout on its own */
+	plane = drmModeGetPlane(fd, plane_id);
+	if (!plane)
+		return -errno;
+	for (i = 0; i < plane->count_formats && !err; i++)
+		err = scanout_add(scanout, plane->formats[i],
+				DRM_FORMAT_MOD_INVALID);
+	drmModeFreePlane(plane);
+
+	return err;
+}
+
+/*
+ * Query the formats and modifiers the display planes of the KMS device fd
+ * accept.  The queries only read.  The client caps of fd are left as the
+ * compositor set them, so only the planes it sees are probed; without
+ * universal planes, those are the overlays.  Return NULL when fd has no
+ * planes.
+ */
+struct gralloc_drm_scanout_t *gralloc_drm_scanout_create(int fd)
+{
+	struct gralloc_drm_scanout_t *scanout;
+	drmModeResPtr res;
+	drmModePlaneResPtr planes;
+	uint32_t i;
+	int err = 0;
+
+	res = drmModeGetResources(fd);
+	if (!res)
+		return NULL;
+
+	scanout = (struct gralloc_drm_scanout_t *) calloc(1, sizeof(*scanout));
+	if (!scanout) {
+		drmModeFreeResources(res);
+		return NULL;
+	}
+	scanout->max_width = res->max_width;
+	scanout->max_height = res->max_height;
+	drmModeFreeResources(res);
+
+	planes = drmModeGetPlaneResources(fd);
+	if (planes) {
+		for (i = 0; i < planes->count_planes && err >= 0; i++)
+			err = scanout_add_plane(scanout, fd, planes->planes[i]);
+		drmModeFreePlaneResources(planes);
+	}
+
+	if (err < 0 || !scanout->count) {
+		ALOGE("failed to query the display planes");
+		gralloc_drm_scanout_destroy(scanout);
+		return NULL;
+	}
+
+	ALOGI("display planes accept %d format and modifier pairs",
+			scanout->count);
+
+	return scanout;
+}
+
+void gralloc_drm_scanout_destroy(struct gralloc_drm_scanout_t *scanout)
+{
+	free(scanout->formats);
+	free(scanout);
+}
+
+/*
+ * Return non-zero when a plane accepts a width x height image of a DRM
+ * format and modifier.  A modifier of DRM_FORMAT_MOD_INVALID matches any
+ * the planes accept for the format.  Planes reporting no modifiers are
+ * assumed to accept any.
+ */
+int gralloc_drm_scanout_supports(const struct gralloc_drm_scanout_t *scanout,
+		uint32_t format, uint64_t modifier, int width, int height)
+{
+	int i;
+
+	if ((scanout->max_width && (uint32_t) width > scanout->max_width) ||
+	    (scanout->max_height && (uint32_t) height > scanout->max_height))
+		return 0;
+
+	for (i = 0; i < scanout->count; i++) {
+		const struct gralloc_drm_plane_format_t *f = &scanout->formats[i];
+
+		if (f->format != format)
+			continue;
+		if (f->modifier == modifier ||
+		    f->modifier == DRM_FORMAT_MOD_INVALID ||
+		    modifier == DRM_FORMAT_MOD_INVALID)
+			return 1;
+	}
+
+	return 0;
+}
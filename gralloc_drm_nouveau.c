@@ -35,6 +35,7 @@
 #include <nouveau_drmif.h>
 #include <nouveau_channel.h>
 #include <nouveau_bo.h>
+#include <drm_fourcc.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
@@ -65,7 +66,8 @@ struct nouveau_buffer {
 };
 
 static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
-		int width, int height, int cpp, int usage, int *pitch)
+		int width, int height, int cpp, int usage, int layers,
+		int *pitch, int *layer_stride)
 {
 	struct nouveau_bo *bo = NULL;
 	int flags, tile_mode, tile_flags;
@@ -76,7 +78,7 @@ static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
 	tile_mode = 0;
 	tile_flags = 0;
 
-	scanout = !!(usage & GRALLOC_USAGE_HW_FB);
+	scanout = !!(usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER));
 
 	tiled = !(usage & (GRALLOC_USAGE_SW_READ_OFTEN |
 			   GRALLOC_USAGE_SW_WRITE_OFTEN));
@@ -84,6 +86,13 @@ static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
 		tiled = 0;
 	else if (scanout && info->tiled_scanout)
 		tiled = 1;
+	/* the CPU writes front buffers through a linear mapping */
+	if (usage & GRALLOC_DRM_USAGE_FRONT_BUFFER)
+		tiled = 0;
+
+	/* pre-NV50 tiling regions know 16 and 32 bit pixels only */
+	if (info->arch < 0x50 && cpp > 4)
+		tiled = 0;
 
 	/* calculate pitch align */
 	align = 64;
@@ -161,10 +170,35 @@ static struct nouveau_bo *alloc_bo(struct nouveau_info *info,
 	if (scanout)
 		tile_flags |= NOUVEAU_BO_TILE_SCANOUT;
 
-	if (nouveau_bo_new_tile(info->dev, flags, 0, *pitch * height,
+	/* layers are stored back to back, each starting on a tile row */
+	*layer_stride = *pitch * height;
+
+	if (nouveau_bo_new_tile(info->dev, flags, 0, *layer_stride * layers,
 				tile_mode, tile_flags, &bo)) {
 		ALOGE("failed to allocate bo (flags 0x%x, size %d, tile_mode 0x%x, tile_flags 0x%x)",
-				flags, *pitch * height, tile_mode, tile_flags);
+				flags, *layer_stride * layers, tile_mode, tile_flags);
+		bo = NULL;
+	}
+
+	return bo;
+}
+
+static struct nouveau_bo *alloc_blob(struct nouveau_info *info,
+		int size, int usage)
+{
+	struct nouveau_bo *bo = NULL;
+	int flags;
+
+	/* CPU-shared data lives in GART, GPU-only data in VRAM */
+	flags = NOUVEAU_BO_MAP;
+	if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+		flags |= NOUVEAU_BO_GART;
+	else
+		flags |= NOUVEAU_BO_VRAM;
+
+	if (nouveau_bo_new_tile(info->dev, flags, 0, size, 0, 0, &bo)) {
+		ALOGE("failed to allocate blob bo (flags 0x%x, size %d)",
+				flags, size);
 		bo = NULL;
 	}
 
@@ -203,8 +237,18 @@ nouveau_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle
 		height = handle->height;
 		gralloc_drm_align_geometry(handle->format, &width, &height);
 
-		nb->bo = alloc_bo(info, width, height,
-				cpp, handle->usage, &pitch);
+		if (handle->format == HAL_PIXEL_FORMAT_BLOB) {
+			nb->bo = alloc_blob(info, width, handle->usage);
+			pitch = width;
+		}
+		else {
+			nb->bo = alloc_bo(info, width, height,
+					cpp, handle->usage, handle->layer_count,
+					&pitch, &handle->layer_stride);
+			/* no modifier describes nouveau tiling */
+			if (nb->bo && nb->bo->tile_mode)
+				handle->modifier = DRM_FORMAT_MOD_INVALID;
+		}
 		if (!nb->bo) {
 			ALOGE("failed to allocate nouveau bo %dx%dx%d",
 					handle->width, handle->height, cpp);
@@ -223,7 +267,7 @@ nouveau_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t *handle
 		handle->stride = pitch;
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
+	if (handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER))
 		nb->base.fb_handle = nb->bo->handle;
 
 	nb->base.handle = handle;
@@ -259,6 +303,35 @@ static int nouveau_map(struct gralloc_drm_drv_t *drv,
 	return err;
 }
 
+static int nouveau_map_unsynchronized(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	struct nouveau_buffer *nb = (struct nouveau_buffer *) bo;
+	uint32_t flags;
+	int err;
+
+	flags = NOUVEAU_BO_RD | NOUVEAU_BO_NOSYNC;
+	if (enable_write)
+		flags |= NOUVEAU_BO_WR;
+
+	err = nouveau_bo_map(nb->bo, flags);
+	if (!err)
+		*addr = nb->bo->map;
+
+	return err;
+}
+
+static int nouveau_busy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int write)
+{
+	struct nouveau_buffer *nb = (struct nouveau_buffer *) bo;
+
+	/* a read only waits for pending GPU writes */
+	return (nouveau_bo_busy(nb->bo,
+				(write) ? NOUVEAU_BO_RDWR : NOUVEAU_BO_RD) != 0);
+}
+
 static void nouveau_unmap(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo)
 {
@@ -357,6 +430,8 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_nouveau(int fd)
 	info->base.free = nouveau_free;
 	info->base.map = nouveau_map;
 	info->base.unmap = nouveau_unmap;
+	info->base.busy = nouveau_busy;
+	info->base.map_unsynchronized = nouveau_map_unsynchronized;
 
 	return &info->base;
 }
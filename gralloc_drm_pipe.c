@@ -32,6 +32,8 @@
 #include <util/u_inlines.h>
 #include <util/u_memory.h>
 
+#include <drm_fourcc.h>
+
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
 
@@ -74,8 +76,26 @@ static enum pipe_format get_pipe_format(int format)
 	case HAL_PIXEL_FORMAT_BGRA_8888:
 		fmt = PIPE_FORMAT_B8G8R8A8_UNORM;
 		break;
+	case HAL_PIXEL_FORMAT_BLOB:
+	case HAL_PIXEL_FORMAT_Y8:
+		fmt = PIPE_FORMAT_R8_UNORM;
+		break;
+	case HAL_PIXEL_FORMAT_Y16:
+	case HAL_PIXEL_FORMAT_RAW16:
+		fmt = PIPE_FORMAT_R16_UNORM;
+		break;
+	case HAL_PIXEL_FORMAT_RGBA_1010102:
+		fmt = PIPE_FORMAT_R10G10B10A2_UNORM;
+		break;
+	case HAL_PIXEL_FORMAT_RGBA_FP16:
+		fmt = PIPE_FORMAT_R16G16B16A16_FLOAT;
+		break;
+	case HAL_PIXEL_FORMAT_RAW10:
+	case HAL_PIXEL_FORMAT_RAW12:
 	case HAL_PIXEL_FORMAT_YV12:
 	case HAL_PIXEL_FORMAT_DRM_NV12:
+	case HAL_PIXEL_FORMAT_DRM_P010:
+	case HAL_PIXEL_FORMAT_DRM_P016:
 	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
 	default:
@@ -99,7 +119,7 @@ static unsigned get_pipe_bind(int usage)
 		bind |= PIPE_BIND_SAMPLER_VIEW;
 	if (usage & GRALLOC_USAGE_HW_RENDER)
 		bind |= PIPE_BIND_RENDER_TARGET;
-	if (usage & GRALLOC_USAGE_HW_FB) {
+	if (usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER)) {
 		bind |= PIPE_BIND_RENDER_TARGET;
 		bind |= PIPE_BIND_SCANOUT;
 	}
@@ -116,7 +136,14 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 	memset(&templ, 0, sizeof(templ));
 	templ.format = get_pipe_format(handle->format);
 	templ.bind = get_pipe_bind(handle->usage);
-	templ.target = PIPE_TEXTURE_2D;
+	templ.target = (handle->format == HAL_PIXEL_FORMAT_BLOB) ?
+		PIPE_BUFFER : PIPE_TEXTURE_2D;
+
+	/* the layout of array resources is private to the pipe driver */
+	if (handle->layer_count > 1) {
+		ALOGE("layered buffers are not supported");
+		return NULL;
+	}
 
 	if (templ.format == PIPE_FORMAT_NONE ||
 	    !pm->screen->is_format_supported(pm->screen, templ.format,
@@ -159,7 +186,7 @@ static struct pipe_buffer *get_pipe_buffer_locked(struct pipe_manager *pm,
 	}
 
 	/* need the gem handle for fb */
-	if (handle->usage & GRALLOC_USAGE_HW_FB) {
+	if (handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER)) {
 		struct winsys_handle tmp;
 
 		memset(&tmp, 0, sizeof(tmp));
@@ -195,6 +222,8 @@ static struct gralloc_drm_bo_t *pipe_alloc(struct gralloc_drm_drv_t *drv,
 	if (buf) {
 		handle->name = (int) buf->winsys.handle;
 		handle->stride = (int) buf->winsys.stride;
+		/* the layout is private to the pipe driver */
+		handle->modifier = DRM_FORMAT_MOD_INVALID;
 
 		buf->base.handle = handle;
 	}
@@ -218,9 +247,9 @@ static void pipe_free(struct gralloc_drm_drv_t *drv, struct gralloc_drm_bo_t *bo
 	FREE(buf);
 }
 
-static int pipe_map(struct gralloc_drm_drv_t *drv,
-		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
-		int enable_write, void **addr)
+static int pipe_map_flags(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int enable_write,
+		unsigned flags, void **addr)
 {
 	struct pipe_manager *pm = (struct pipe_manager *) drv;
 	struct pipe_buffer *buf = (struct pipe_buffer *) bo;
@@ -240,7 +269,7 @@ static int pipe_map(struct gralloc_drm_drv_t *drv,
 	if (!err) {
 		enum pipe_transfer_usage usage;
 
-		usage = PIPE_TRANSFER_READ;
+		usage = PIPE_TRANSFER_READ | flags;
 		if (enable_write)
 			usage |= PIPE_TRANSFER_WRITE;
 
@@ -263,6 +292,21 @@ static int pipe_map(struct gralloc_drm_drv_t *drv,
 	return err;
 }
 
+static int pipe_map(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	return pipe_map_flags(drv, bo, enable_write, 0, addr);
+}
+
+static int pipe_map_unsynchronized(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
+		int enable_write, void **addr)
+{
+	return pipe_map_flags(drv, bo, enable_write,
+			PIPE_TRANSFER_UNSYNCHRONIZED, addr);
+}
+
 static void pipe_unmap(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo)
 {
@@ -479,6 +523,7 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *na
 	pm->base.free = pipe_free;
 	pm->base.map = pipe_map;
 	pm->base.unmap = pipe_unmap;
+	pm->base.map_unsynchronized = pipe_map_unsynchronized;
 
 	return &pm->base;
 }
@@ -30,15 +30,88 @@
 
 #include "hwcbuffer.h"
 #include "gralloc_drm_handle.h"
+#include "gralloc_drm_trace.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* nice level of the thread destroying freed bos; ANDROID_PRIORITY_BACKGROUND */
+#define GRALLOC_DRM_FREE_NICE 10
+
+/* dma-bufs of deferred-export bos stay open for this many exports */
+#define GRALLOC_DRM_EXPORT_CACHE_SIZE 16
+
+struct gralloc_drm_export_t {
+	struct gralloc_drm_bo_t *bo;
+	int fd;
+	int pins; /* resolves using the fd; not evicted while non-zero */
+};
+
 struct gralloc_drm_t {
 	/* initialized by gralloc_drm_create */
 	int fd;
 	struct gralloc_drm_drv_t *drv;
+	int content_hash; /* hash written rows, see gralloc_drm_bo_unlock */
+	int deferred_export; /* export dma-bufs on demand, see gralloc_drm_bo_export */
+
+	/* ring of recent exports, oldest at export_next */
+	pthread_mutex_t export_mutex;
+	struct gralloc_drm_export_t exports[GRALLOC_DRM_EXPORT_CACHE_SIZE];
+	int export_next;
+
+	/*
+	 * what the display planes accept, or NULL; probed on the first
+	 * scanout allocation after the display fd is set, see
+	 * gralloc_drm_get_scanout
+	 */
+	pthread_mutex_t scanout_mutex;
+	int scanout_probed;
+	struct gralloc_drm_scanout_t *scanout;
+
+	/* runs background jobs such as pre-warming, or NULL */
+	struct gralloc_drm_worker_t *worker;
+	int prewarm; /* pre-warm HW_FB and cursor bos, see gralloc_drm_bo_prewarm */
+	int display_fd; /* the compositor's KMS fd for framebuffers, or -1 */
+	/* signalled when a bo finishes pre-warming */
+	pthread_mutex_t prewarm_mutex;
+	pthread_cond_t prewarm_cond;
+
+	/* destroys bos freed by this process in batches, or NULL */
+	struct gralloc_drm_worker_t *free_worker;
+	pthread_mutex_t free_mutex;
+	pthread_cond_t free_cond;
+	struct gralloc_drm_bo_t *free_list; /* linked through free_next */
+	int free_queued;  /* a batch job is queued */
+	int free_running; /* a batch is being destroyed */
+
+	int dmabuf_names; /* name exported dma-bufs, see gralloc_drm_bo_name_dmabuf */
+	char dmabuf_client[16]; /* the name of this process, for dma-buf names */
+
+	/* samples allocation backtraces, or NULL */
+	struct gralloc_drm_sampler_t *sampler;
+
+	/* counters served on a socket, or NULL */
+	struct gralloc_drm_stats_t *stats;
+};
+
+/* counters of gralloc_drm_stats_count */
+enum {
+	GRALLOC_DRM_STAT_ALLOC,
+	GRALLOC_DRM_STAT_ALLOC_FAIL,
+	GRALLOC_DRM_STAT_IMPORT,
+	GRALLOC_DRM_STAT_FREE,
+	GRALLOC_DRM_STAT_LOCK,
+	GRALLOC_DRM_STAT_EXPORT_HIT,	/* a deferred export found its fd */
+	GRALLOC_DRM_STAT_EXPORT_MISS,
+	/* calls into the driver that reach the kernel */
+	GRALLOC_DRM_STAT_DRV_ALLOC,
+	GRALLOC_DRM_STAT_DRV_EXPORT,
+	GRALLOC_DRM_STAT_DRV_RESOLVE,
+	GRALLOC_DRM_STAT_DRV_PREWARM,
+	GRALLOC_DRM_STAT_DMABUF_NAME,
+
+	GRALLOC_DRM_STAT_COUNT
 };
 
 struct drm_module_t {
@@ -48,7 +121,27 @@ struct drm_module_t {
 	struct gralloc_drm_t *drm;
 };
 
+/* a format and modifier pair a display plane accepts */
+struct gralloc_drm_plane_format_t {
+	uint32_t format;	/* DRM fourcc */
+	uint64_t modifier;	/* DRM_FORMAT_MOD_INVALID when unreported */
+};
+
+/* what the display planes of the KMS device accept */
+struct gralloc_drm_scanout_t {
+	int count;
+	struct gralloc_drm_plane_format_t *formats;
+	uint32_t max_width, max_height;
+};
+
 struct gralloc_drm_drv_t {
+	/*
+	 * Set by gralloc before the first allocation with
+	 * GRALLOC_DRM_USAGE_SCANOUT usage, NULL when the display is
+	 * unknown.  Drivers pick layouts from it for those buffers.
+	 */
+	const struct gralloc_drm_scanout_t *scanout;
+
 	/* destroy the driver */
 	void (*destroy)(struct gralloc_drm_drv_t *drv);
 
@@ -69,6 +162,55 @@ struct gralloc_drm_drv_t {
 	void (*unmap)(struct gralloc_drm_drv_t *drv,
 		      struct gralloc_drm_bo_t *bo);
 
+	/*
+	 * Optional.  Return non-zero when the GPU still uses a bo in a way
+	 * that a map for reading, or for writing when write is set, would
+	 * wait for.  A read only waits for GPU writes.  Drivers that cannot
+	 * tell the accesses apart may report any use.  Drivers whose map
+	 * never waits leave it NULL.
+	 */
+	int (*busy)(struct gralloc_drm_drv_t *drv,
+		    struct gralloc_drm_bo_t *bo, int write);
+
+	/*
+	 * Optional.  Like map, but do not wait for the GPU.  The caller
+	 * does its own synchronization.  Undone by unmap.
+	 */
+	int (*map_unsynchronized)(struct gralloc_drm_drv_t *drv,
+		   struct gralloc_drm_bo_t *bo,
+		   int x, int y, int w, int h, int enable_write, void **addr);
+
+	/*
+	 * Optional.  Return non-zero when the current mapping of a bo is
+	 * CPU cached, so that staged reads can use it directly.
+	 */
+	int (*map_cached)(struct gralloc_drm_drv_t *drv,
+			  struct gralloc_drm_bo_t *bo);
+
+	/*
+	 * Optional.  Make CPU writes to a range of the mapping of a bo
+	 * visible to the GPU and display.
+	 */
+	void (*flush_range)(struct gralloc_drm_drv_t *drv,
+			    struct gralloc_drm_bo_t *bo,
+			    void *addr, size_t size);
+
+	/*
+	 * Optional.  Export a bo as a new dma-buf fd.  Drivers providing it
+	 * skip the export at allocation for handles flagged
+	 * GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT.
+	 */
+	int (*export_fd)(struct gralloc_drm_drv_t *drv,
+			 struct gralloc_drm_bo_t *bo, int *fd);
+
+	/*
+	 * Optional.  Bind a bo where the display fetches from, so that its
+	 * first flip does not stall.  The bo may already be in use, so its
+	 * contents must not be written.
+	 */
+	int (*prewarm)(struct gralloc_drm_drv_t *drv,
+		       struct gralloc_drm_bo_t *bo);
+
 	/* query component offsets, strides and handles for a format */
 	void (*resolve_format)(struct gralloc_drm_drv_t *drv,
 		     struct gralloc_drm_bo_t *bo,
@@ -81,20 +223,158 @@ struct gralloc_drm_drv_t {
 			struct HwcBuffer *hwc_bo);
 };
 
+/*
+ * Layout constraints of a codec, camera or display engine.  Every entry
+ * matching a buffer's format and usage applies, so a buffer shared by a
+ * decoder, an encoder and the display satisfies all of them.
+ */
+struct gralloc_drm_codec_constraint_t {
+	int format;		/* HAL format, or 0 for any format */
+	int usage;		/* any of these usage bits, or 0 for any usage */
+	int width_align;	/* in pixels */
+	int height_align;	/* in rows */
+	int extra_rows;		/* padding rows below the last plane */
+	int mb_extra_bytes;	/* padding bytes per 16x16 macroblock */
+};
+
+/*
+ * State of a bo shared by every process using it, in the ashmem region
+ * passed as the meta_fd of its handle.
+ */
+struct gralloc_drm_meta_t {
+	uint32_t magic;
+	/* of the bo; sub-rectangle aliases share the metadata of their bo */
+	int32_t height;
+
+	/* rows of the current frame that the writer has published */
+	volatile int32_t published_rows;
+	/* bumped on every publish; waiters sleep on it */
+	volatile int32_t publish_seq;
+
+	/* bumped whenever the content may have changed */
+	volatile int32_t generation;
+
+	/* rows and hash of the last CPU write, with content hashing */
+	int32_t hash_valid;
+	int32_t hash_y;
+	int32_t hash_h;
+	uint64_t hash;
+
+	/* the robust futex list entry of the owner of damage_lock */
+	uint64_t damage_node __attribute__((aligned(8)));
+	/* the tid holding the damage lock, or 0, with FUTEX_* bits */
+	volatile int32_t damage_lock;
+	/* written regions since the last fetch, as x, y, w, h */
+	int32_t damage_count;
+	int32_t damage[GRALLOC_DRM_MAX_DAMAGE_RECTS][4];
+};
+#define GRALLOC_DRM_META_MAGIC 0x4d455441
+#define GRALLOC_DRM_META_SIZE 4096
+
 struct gralloc_drm_bo_t {
 	struct gralloc_drm_t *drm;
 	struct gralloc_drm_handle_t *handle;
 
 	int imported;  /* the handle is from a remote proces when true */
+	uint32_t trace_id; /* names the bo in flight recorder events */
 	uint32_t fb_handle; /* the GEM handle of the bo */
 	int fb_id;     /* the fb id */
 
-	int lock_count;
-	int locked_for;
+	/*
+	 * > 0 for the number of readers, -1 for a writer, 0 when unlocked.
+	 * The lock fields of an alias are unused; it locks its parent.
+	 */
+	volatile int32_t lock_state;
+	/* non-zero once lock_addr holds the mapping shared by the holders */
+	volatile int32_t lock_mapped;
+	void *lock_addr;
+	/* serializes the transitions from and to unlocked */
+	pthread_mutex_t lock_mutex;
+
+	/* the bo or alias holding the write lock, its layer and region */
+	struct gralloc_drm_bo_t *write_bo;
+	int write_layer;
+	int write_x, write_y, write_w, write_h;
+
+	/* cached copy of [staging_start, staging_end) of the mapping */
+	uint8_t *staging;
+	size_t staging_start;
+	size_t staging_end;
+
+	volatile int32_t refcount;
+
+	/* the bytes behind a dma-buf once known, see gralloc_drm_bo_storage_size */
+	size_t storage_size;
 
-	unsigned int refcount;
+	/* non-zero until the worker has pre-warmed the bo */
+	volatile int32_t prewarm_pending;
+
+	/* next bo waiting to be destroyed, see gralloc_drm_bo_decref */
+	struct gralloc_drm_bo_t *free_next;
+
+	/* the bo a sub-rectangle handle aliases; holds a reference */
+	struct gralloc_drm_bo_t *parent;
+
+	/* mapping of the shared metadata, or NULL */
+	struct gralloc_drm_meta_t *meta;
+
+	/* the stack of the sampled allocation and the bytes it stands for */
+	struct gralloc_drm_sample_stack_t *sample;
+	size_t sample_bytes;
+
+	/* the bytes in the live totals of the stats, or 0 */
+	size_t stats_bytes;
 };
 
+int gralloc_drm_bo_resolve_buffer(struct gralloc_drm_bo_t *bo, int fd,
+		struct HwcBuffer *hwc_bo);
+
+int gralloc_drm_bo_lock_storage(struct gralloc_drm_bo_t *bo, int write,
+		void **addr, size_t *size);
+
+struct gralloc_drm_scanout_t *gralloc_drm_scanout_create(int fd);
+void gralloc_drm_scanout_destroy(struct gralloc_drm_scanout_t *scanout);
+int gralloc_drm_scanout_supports(const struct gralloc_drm_scanout_t *scanout,
+		uint32_t format, uint64_t modifier, int width, int height);
+
+struct gralloc_drm_worker_t *gralloc_drm_worker_create(int nice);
+void gralloc_drm_worker_destroy(struct gralloc_drm_worker_t *worker);
+int gralloc_drm_worker_queue(struct gralloc_drm_worker_t *worker,
+		void (*func)(void *data), void *data);
+
+struct gralloc_drm_sampler_t *gralloc_drm_sampler_create(size_t interval);
+void gralloc_drm_sampler_destroy(struct gralloc_drm_sampler_t *sampler);
+void gralloc_drm_sampler_alloc(struct gralloc_drm_sampler_t *sampler,
+		struct gralloc_drm_bo_t *bo, size_t size);
+void gralloc_drm_sampler_free(struct gralloc_drm_sampler_t *sampler,
+		struct gralloc_drm_bo_t *bo);
+int gralloc_drm_sampler_print(struct gralloc_drm_sampler_t *sampler,
+		char *buf, int len);
+
+struct gralloc_drm_stats_t *gralloc_drm_stats_create(const char *name,
+		const char *backend);
+void gralloc_drm_stats_destroy(struct gralloc_drm_stats_t *stats);
+void gralloc_drm_stats_count(struct gralloc_drm_stats_t *stats, int counter);
+void gralloc_drm_stats_alloc(struct gralloc_drm_stats_t *stats,
+		int format, int usage, size_t size, uint64_t ns);
+void gralloc_drm_stats_free(struct gralloc_drm_stats_t *stats,
+		int format, int usage, size_t size);
+void gralloc_drm_stats_lock(struct gralloc_drm_stats_t *stats, uint64_t ns);
+const char *gralloc_drm_usage_class(int usage);
+
+void gralloc_drm_trace(uint32_t type, uint32_t id, uint32_t arg0,
+		uint32_t arg1);
+int gralloc_drm_trace_dump(int fd);
+int gralloc_drm_trace_print(char *buf, int len, int per_thread);
+void gralloc_drm_trace_install(const char *dir);
+
+void gralloc_drm_copy_from_uncached(void *dst, const void *src, size_t size);
+uint64_t gralloc_drm_hash(uint64_t seed, const void *data, size_t size);
+
+void gralloc_drm_codec_align(const struct gralloc_drm_codec_constraint_t *constraints,
+		int count, int format, int usage, int *width, int *height,
+		int *extra_rows, int *extra_bytes);
+
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_pipe(int fd, const char *name);
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_intel(int fd);
 struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd);
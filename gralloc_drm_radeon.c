@@ -36,6 +36,7 @@
 #include <radeon_drm.h>
 #include <radeon_bo_gem.h>
 #include <radeon_bo.h>
+#include <drm_fourcc.h>
 
 #include "gralloc_drm.h"
 #include "gralloc_drm_priv.h"
@@ -176,6 +177,10 @@ static uint32_t radeon_get_tiling(struct radeon_info *info,
 	if ((handle->usage & sw) && !info->allow_color_tiling)
 		return 0;
 
+	/* the CPU writes front buffers through a linear mapping */
+	if (handle->usage & GRALLOC_DRM_USAGE_FRONT_BUFFER)
+		return 0;
+
 	if (info->chip_family >= CHIP_FAMILY_R600)
 		return RADEON_TILING_MICRO;
 	else
@@ -197,6 +202,33 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 		return NULL;
 	}
 
+	if (handle->format == HAL_PIXEL_FORMAT_BLOB) {
+		/* CPU-shared data lives in GTT, GPU-only data in VRAM */
+		domain = (handle->usage & (GRALLOC_USAGE_SW_READ_MASK |
+					   GRALLOC_USAGE_SW_WRITE_MASK)) ?
+			RADEON_GEM_DOMAIN_GTT : RADEON_GEM_DOMAIN_VRAM;
+
+		rbo = radeon_bo_open(info->bufmgr, 0,
+				ALIGN(handle->width, RADEON_GPU_PAGE_SIZE),
+				RADEON_GPU_PAGE_SIZE, domain, 0);
+		if (!rbo) {
+			ALOGE("failed to allocate blob rbo of %d bytes",
+					handle->width);
+			return NULL;
+		}
+
+		if (radeon_gem_get_kernel_name(rbo,
+					(uint32_t *) &handle->name)) {
+			ALOGE("failed to flink rbo");
+			radeon_bo_unref(rbo);
+			return NULL;
+		}
+
+		handle->stride = handle->width;
+
+		return rbo;
+	}
+
 	tiling = radeon_get_tiling(info, handle);
 	domain = RADEON_GEM_DOMAIN_VRAM;
 
@@ -205,7 +237,9 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	gralloc_drm_align_geometry(handle->format,
 			&aligned_width, &aligned_height);
 
-	if (handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_TEXTURE)) {
+	if (handle->usage & (GRALLOC_USAGE_HW_FB |
+			     GRALLOC_DRM_USAGE_FRONT_BUFFER |
+			     GRALLOC_USAGE_HW_TEXTURE)) {
 		aligned_width = ALIGN(aligned_width,
 				radeon_get_pitch_align(info, cpp, tiling));
 		aligned_height = ALIGN(aligned_height,
@@ -213,6 +247,7 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	}
 
 	if (!(handle->usage & (GRALLOC_USAGE_HW_FB |
+			       GRALLOC_DRM_USAGE_FRONT_BUFFER |
 			       GRALLOC_USAGE_HW_RENDER)) &&
 	    (handle->usage & GRALLOC_USAGE_SW_READ_OFTEN))
 		domain = RADEON_GEM_DOMAIN_GTT;
@@ -221,6 +256,10 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 	size = ALIGN(aligned_height * pitch, RADEON_GPU_PAGE_SIZE);
 	base_align = radeon_get_base_align(info, cpp, tiling);
 
+	/* layers are stored back to back, each base aligned */
+	handle->layer_stride = ALIGN(size, base_align);
+	size = handle->layer_stride * handle->layer_count;
+
 	rbo = radeon_bo_open(info->bufmgr, 0, size, base_align, domain, 0);
 	if (!rbo) {
 		ALOGE("failed to allocate rbo %dx%dx%d",
@@ -228,8 +267,11 @@ static struct radeon_bo *radeon_alloc(struct radeon_info *info,
 		return NULL;
 	}
 
-	if (tiling)
+	if (tiling) {
 		radeon_bo_set_tiling(rbo, tiling, pitch);
+		/* no modifier describes radeon tiling */
+		handle->modifier = DRM_FORMAT_MOD_INVALID;
+	}
 
 	if (radeon_gem_get_kernel_name(rbo,
 				(uint32_t *) &handle->name)) {
@@ -284,7 +326,7 @@ drm_gem_radeon_alloc(struct gralloc_drm_drv_t *drv, struct gralloc_drm_handle_t
 		radeon_zero(info, rbuf->rbo);
 	}
 
-	if (handle->usage & GRALLOC_USAGE_HW_FB)
+	if (handle->usage & (GRALLOC_USAGE_HW_FB | GRALLOC_DRM_USAGE_FRONT_BUFFER))
 		rbuf->base.fb_handle = rbuf->rbo->handle;
 
 	rbuf->base.handle = handle;
@@ -320,6 +362,16 @@ static void drm_gem_radeon_unmap(struct gralloc_drm_drv_t *drv,
 	radeon_bo_unmap(rbuf->rbo);
 }
 
+static int drm_gem_radeon_busy(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int write)
+{
+	/* radeon cannot tell reads from writes; any use counts */
+	struct radeon_buffer *rbuf = (struct radeon_buffer *) bo;
+	uint32_t domain;
+
+	return (radeon_bo_is_busy(rbuf->rbo, &domain) == -EBUSY);
+}
+
 static void drm_gem_radeon_destroy(struct gralloc_drm_drv_t *drv)
 {
 	struct radeon_info *info = (struct radeon_info *) drv;
@@ -529,6 +581,8 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_radeon(int fd)
 	info->base.free = drm_gem_radeon_free;
 	info->base.map = drm_gem_radeon_map;
 	info->base.unmap = drm_gem_radeon_unmap;
+	/* radeon_bo_map always waits; there is no unsynchronized map */
+	info->base.busy = drm_gem_radeon_busy;
 
 	return &info->base;
 }
@@ -3,6 +3,7 @@
 #include <cutils/log.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <drm.h>
 #include <rockchip/rockchip_drmif.h>
 
@@ -10,6 +11,25 @@
 #include "gralloc_drm_priv.h"
 
 #define UNUSED(...) (void)(__VA_ARGS__)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define ROCKCHIP_USAGE_CAMERA \
+	(GRALLOC_USAGE_HW_CAMERA_WRITE | GRALLOC_USAGE_HW_CAMERA_READ)
+
+static const struct gralloc_drm_codec_constraint_t rockchip_codec_constraints[] = {
+	/*
+	 * The H264 decoder writes additional data past the end of its
+	 * destination buffers.  Decoders have no usage bit of their own.
+	 */
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888, 0, 1, 1, 0, 64 },
+	/* the VPU encodes whole macroblocks */
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888, GRALLOC_USAGE_HW_VIDEO_ENCODER, 16, 16, 0, 0 },
+	{ HAL_PIXEL_FORMAT_YCrCb_420_SP, GRALLOC_USAGE_HW_VIDEO_ENCODER, 16, 16, 0, 0 },
+	{ HAL_PIXEL_FORMAT_YV12, GRALLOC_USAGE_HW_VIDEO_ENCODER, 16, 16, 0, 0 },
+	/* the ISP writes lines of 16 pixels and pairs of rows */
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888, ROCKCHIP_USAGE_CAMERA, 16, 2, 0, 0 },
+	{ HAL_PIXEL_FORMAT_YCrCb_420_SP, ROCKCHIP_USAGE_CAMERA, 16, 2, 0, 0 },
+};
 
 struct rockchip_info {
 	struct gralloc_drm_drv_t base;
@@ -41,6 +61,7 @@ static struct gralloc_drm_bo_t *drm_gem_rockchip_alloc(
 	struct rockchip_buffer *buf;
 	struct drm_gem_close args;
 	int ret, cpp, pitch, aligned_width, aligned_height;
+	int extra_rows, extra_bytes;
 	uint32_t size, gem_handle;
 
 	buf = calloc(1, sizeof(*buf));
@@ -57,23 +78,36 @@ static struct gralloc_drm_bo_t *drm_gem_rockchip_alloc(
 
 	aligned_width = handle->width;
 	aligned_height = handle->height;
+	gralloc_drm_codec_align(rockchip_codec_constraints,
+			ARRAY_SIZE(rockchip_codec_constraints),
+			handle->format, handle->usage,
+			&aligned_width, &aligned_height,
+			&extra_rows, &extra_bytes);
 	gralloc_drm_align_geometry(handle->format,
 			&aligned_width, &aligned_height);
 
 	/* TODO: We need to sort out alignment */
-	pitch = ALIGN(aligned_width * cpp, 64);
-	size = aligned_height * pitch;
-
-	if (handle->format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
-		/*
-		 * WAR for H264 decoder requiring additional space
-		 * at the end of destination buffers.
-		 */
-		uint32_t w_mbs, h_mbs;
-
-		w_mbs = ALIGN(handle->width, 16) / 16;
-		h_mbs = ALIGN(handle->height, 16) / 16;
-		size += 64 * w_mbs * h_mbs;
+	if (handle->format == HAL_PIXEL_FORMAT_BLOB)
+		pitch = aligned_width;
+	else
+		pitch = ALIGN(aligned_width * cpp, 64);
+	size = (aligned_height + extra_rows) * pitch + extra_bytes;
+
+	/* layers are stored back to back, each 64 byte aligned */
+	if (!(handle->flags & (GRALLOC_DRM_HANDLE_FLAG_EXTERNAL |
+			       GRALLOC_DRM_HANDLE_FLAG_SUBRECT))) {
+		handle->layer_stride = ALIGN(size, 64);
+		size = handle->layer_stride * handle->layer_count;
+	}
+
+	if (handle->flags & (GRALLOC_DRM_HANDLE_FLAG_EXTERNAL |
+			     GRALLOC_DRM_HANDLE_FLAG_SUBRECT)) {
+		/* the layout is given; size is that of the dma-buf */
+		off_t end = lseek(handle->prime_fd, 0, SEEK_END);
+
+		if (end > 0)
+			size = end;
+		pitch = handle->stride;
 	}
 
 	if (handle->prime_fd >= 0) {
@@ -87,6 +121,7 @@ static struct gralloc_drm_bo_t *drm_gem_rockchip_alloc(
 			goto err;
 		}
 		ALOGV("Got handle %d for fd %d\n", gem_handle, handle->prime_fd);
+		buf->base.fb_handle = gem_handle;
 
 		buf->bo = rockchip_bo_from_handle(info->rockchip, gem_handle,
 			0, size);
@@ -108,12 +143,15 @@ static struct gralloc_drm_bo_t *drm_gem_rockchip_alloc(
 		}
 
 		gem_handle = rockchip_bo_handle(buf->bo);
-		ret = drmPrimeHandleToFD(info->fd, gem_handle, 0,
-			&handle->prime_fd);
-		ALOGV("Got fd %d for handle %d\n", handle->prime_fd, gem_handle);
-		if (ret) {
-			ALOGE("failed to get prime fd %d", ret);
-			goto err_unref;
+		/* gralloc exports on demand; see drm_gem_rockchip_export_fd */
+		if (!(handle->flags & GRALLOC_DRM_HANDLE_FLAG_DEFERRED_EXPORT)) {
+			ret = drmPrimeHandleToFD(info->fd, gem_handle, 0,
+				&handle->prime_fd);
+			ALOGV("Got fd %d for handle %d\n", handle->prime_fd, gem_handle);
+			if (ret) {
+				ALOGE("failed to get prime fd %d", ret);
+				goto err_unref;
+			}
 		}
 
 		buf->base.fb_handle = gem_handle;
@@ -147,6 +185,15 @@ static void drm_gem_rockchip_free(struct gralloc_drm_drv_t *drv,
 	free(buf);
 }
 
+static int drm_gem_rockchip_export_fd(struct gralloc_drm_drv_t *drv,
+		struct gralloc_drm_bo_t *bo, int *fd)
+{
+	struct rockchip_info *info = (struct rockchip_info *)drv;
+	struct rockchip_buffer *buf = (struct rockchip_buffer *)bo;
+
+	return drmPrimeHandleToFD(info->fd, rockchip_bo_handle(buf->bo), 0, fd);
+}
+
 static int drm_gem_rockchip_map(struct gralloc_drm_drv_t *drv,
 		struct gralloc_drm_bo_t *bo, int x, int y, int w, int h,
 		int enable_write, void **addr)
@@ -194,6 +241,8 @@ struct gralloc_drm_drv_t *gralloc_drm_drv_create_for_rockchip(int fd)
 	info->base.free = drm_gem_rockchip_free;
 	info->base.map = drm_gem_rockchip_map;
 	info->base.unmap = drm_gem_rockchip_unmap;
+	info->base.export_fd = drm_gem_rockchip_export_fd;
+	/* rockchip_bo_map never waits, so busy and map_unsynchronized are moot */
 
 	return &info->base;
 }
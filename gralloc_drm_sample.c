@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-SAMPLE"
+
+#include <cutils/log.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unwind.h>
+#include <sys/prctl.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+#define SAMPLE_MAX_FRAMES 16
+#define SAMPLE_MAX_STACKS 1024
+/* the frames of the sampler and of gralloc_drm_bo_create_layered */
+#define SAMPLE_SKIP_FRAMES 2
+/* stacks printed by gralloc_drm_sampler_print */
+#define SAMPLE_PRINT_STACKS 16
+
+struct gralloc_drm_sample_stack_t {
+	uint32_t hash; /* 0 when the slot is free */
+	int depth;
+	uintptr_t frames[SAMPLE_MAX_FRAMES];
+	char thread[16]; /* the name of the allocating thread */
+
+	/* estimated from the samples, see gralloc_drm_sampler_alloc */
+	uint64_t live_bytes;
+	/* samples, each standing for about interval bytes of bos */
+	uint32_t live_count;
+	uint32_t total_count;
+};
+
+struct gralloc_drm_sampler_t {
+	size_t interval; /* mean bytes allocated between samples */
+
+	pthread_mutex_t mutex;
+	/* open addressing on the hash of the frames and thread name */
+	struct gralloc_drm_sample_stack_t stacks[SAMPLE_MAX_STACKS];
+	int count;
+	uint32_t dropped; /* samples lost to a full table */
+};
+
+/* bytes the calling thread may allocate before its next sample */
+static __thread int64_t sample_countdown;
+static __thread unsigned int sample_seed;
+
+struct sample_unwind {
+	uintptr_t *frames;
+	int depth;
+	int skip;
+};
+
+static _Unwind_Reason_Code sample_unwind_frame(struct _Unwind_Context *ctx,
+		void *arg)
+{
+	struct sample_unwind *state = (struct sample_unwind *) arg;
+	uintptr_t ip = _Unwind_GetIP(ctx);
+
+	if (!ip)
+		return _URC_END_OF_STACK;
+	if (state->skip) {
+		state->skip--;
+		return _URC_NO_REASON;
+	}
+
+	state->frames[state->depth++] = ip;
+
+	return (state->depth < SAMPLE_MAX_FRAMES) ?
+		_URC_NO_REASON : _URC_END_OF_STACK;
+}
+
+static uint32_t sample_hash(const uintptr_t *frames, int depth,
+		const char *thread)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < depth; i++)
+		h = (h ^ (uint32_t) (frames[i] ^ (uint64_t) frames[i] >> 32)) *
+			16777619u;
+	for (; *thread; thread++)
+		h = (h ^ (uint8_t) *thread) * 16777619u;
+
+	return (h) ? h : 1;
+}
+
+/*
+ * Draw the bytes until the next sample, uniformly around the interval so
+ * that allocation patterns with the period of the interval are not
+ * always missed or always hit.
+ */
+static int64_t sample_next(const struct gralloc_drm_sampler_t *sampler)
+{
+	if (!sample_seed)
+		sample_seed = (unsigned int) (uintptr_t) &sample_seed;
+
+	return sampler->interval / 2 +
+		(int64_t) (rand_r(&sample_seed) % (sampler->interval + 1));
+}
+
+/*
+ * Create a sampler recording the backtrace of an allocation about every
+ * interval bytes.
+ */
+struct gralloc_drm_sampler_t *gralloc_drm_sampler_create(size_t interval)
+{
+	struct gralloc_drm_sampler_t *sampler;
+
+	if (!interval)
+		return NULL;
+
+	sampler = (struct gralloc_drm_sampler_t *) calloc(1, sizeof(*sampler));
+	if (!sampler)
+		return NULL;
+
+	sampler->interval = interval;
+	pthread_mutex_init(&sampler->mutex, NULL);
+
+	ALOGI("sampling allocation backtraces every %zu bytes", interval);
+
+	return sampler;
+}
+
+void gralloc_drm_sampler_destroy(struct gralloc_drm_sampler_t *sampler)
+{
+	pthread_mutex_destroy(&sampler->mutex);
+	free(sampler);
+}
+
+/*
+ * Account a new bo of size bytes, and sample it when the bytes the thread
+ * allocated since its last sample reach the drawn count.  A sampled bo
+ * stands for the interval bytes before it, or for itself when larger.
+ */
+void gralloc_drm_sampler_alloc(struct gralloc_drm_sampler_t *sampler,
+		struct gralloc_drm_bo_t *bo, size_t size)
+{
+	struct gralloc_drm_sample_stack_t *stack;
+	struct sample_unwind state;
+	uintptr_t frames[SAMPLE_MAX_FRAMES];
+	char thread[16];
+	uint32_t hash, i;
+
+	bo->sample = NULL;
+	bo->sample_bytes = 0;
+
+	if (!sample_countdown)
+		sample_countdown = sample_next(sampler);
+	sample_countdown -= size;
+	if (sample_countdown > 0)
+		return;
+	sample_countdown = sample_next(sampler);
+
+	state.frames = frames;
+	state.depth = 0;
+	state.skip = SAMPLE_SKIP_FRAMES;
+	_Unwind_Backtrace(sample_unwind_frame, &state);
+
+	/*
+	 * in the allocator service this names a binder thread, not the
+	 * client; gralloc does not see the caller
+	 */
+	memset(thread, 0, sizeof(thread));
+	prctl(PR_GET_NAME, thread);
+	thread[sizeof(thread) - 1] = '\0';
+
+	hash = sample_hash(frames, state.depth, thread);
+
+	pthread_mutex_lock(&sampler->mutex);
+	for (i = 0; i < SAMPLE_MAX_STACKS; i++) {
+		stack = &sampler->stacks[(hash + i) % SAMPLE_MAX_STACKS];
+
+		if (!stack->hash) {
+			stack->hash = hash;
+			stack->depth = state.depth;
+			memcpy(stack->frames, frames,
+					sizeof(frames[0]) * state.depth);
+			memcpy(stack->thread, thread, sizeof(thread));
+			sampler->count++;
+			break;
+		}
+		if (stack->hash == hash && stack->depth == state.depth &&
+		    !memcmp(stack->frames, frames,
+			    sizeof(frames[0]) * state.depth) &&
+		    !strcmp(stack->thread, thread))
+			break;
+	}
+
+	if (i < SAMPLE_MAX_STACKS) {
+		bo->sample = stack;
+		bo->sample_bytes = (size > sampler->interval) ?
+			size : sampler->interval;
+		stack->live_bytes += bo->sample_bytes;
+		stack->live_count++;
+		stack->total_count++;
+	}
+	else {
+		sampler->dropped++;
+	}
+	pthread_mutex_unlock(&sampler->mutex);
+}
+
+/*
+ * Take a freed bo off the live bytes of its stack.
+ */
+void gralloc_drm_sampler_free(struct gralloc_drm_sampler_t *sampler,
+		struct gralloc_drm_bo_t *bo)
+{
+	struct gralloc_drm_sample_stack_t *stack = bo->sample;
+
+	if (!stack)
+		return;
+
+	pthread_mutex_lock(&sampler->mutex);
+	stack->live_bytes -= bo->sample_bytes;
+	stack->live_count--;
+	pthread_mutex_unlock(&sampler->mutex);
+
+	bo->sample = NULL;
+}
+
+/*
+ * Print the stacks holding the most live bytes, with their frames as
+ * library offsets for symbolization.  Return the length printed.
+ */
+int gralloc_drm_sampler_print(struct gralloc_drm_sampler_t *sampler,
+		char *buf, int len)
+{
+	struct gralloc_drm_sample_stack_t *top[SAMPLE_PRINT_STACKS];
+	uint64_t total = 0;
+	int count = 0, used = 0;
+	int i, j;
+
+	pthread_mutex_lock(&sampler->mutex);
+
+	for (i = 0; i < SAMPLE_MAX_STACKS; i++) {
+		struct gralloc_drm_sample_stack_t *stack = &sampler->stacks[i];
+
+		if (!stack->hash || !stack->live_bytes)
+			continue;
+		total += stack->live_bytes;
+
+		/* insert into the top stacks, largest first */
+		for (j = count; j > 0 &&
+				top[j - 1]->live_bytes < stack->live_bytes; j--) {
+			if (j < SAMPLE_PRINT_STACKS)
+				top[j] = top[j - 1];
+		}
+		if (j < SAMPLE_PRINT_STACKS) {
+			top[j] = stack;
+			if (count < SAMPLE_PRINT_STACKS)
+				count++;
+		}
+	}
+
+	used += snprintf(buf + used, len - used,
+			"sampled live bytes: %llu in %d stacks, %u samples dropped\n",
+			(unsigned long long) total, sampler->count,
+			sampler->dropped);
+
+	for (i = 0; i < count && used < len; i++) {
+		const struct gralloc_drm_sample_stack_t *stack = top[i];
+
+		used += snprintf(buf + used, len - used,
+				"%llu bytes in %u live samples (%u in total) by thread %s:\n",
+				(unsigned long long) stack->live_bytes,
+				stack->live_count, stack->total_count,
+				stack->thread);
+		for (j = 0; j < stack->depth && used < len; j++) {
+			Dl_info info;
+
+			if (dladdr((void *) stack->frames[j], &info) &&
+			    info.dli_fname)
+				used += snprintf(buf + used, len - used,
+						"  #%02d %s+0x%lx\n", j,
+						info.dli_fname,
+						(unsigned long) (stack->frames[j] -
+							(uintptr_t) info.dli_fbase));
+			else
+				used += snprintf(buf + used, len - used,
+						"  #%02d 0x%lx\n", j,
+						(unsigned long) stack->frames[j]);
+		}
+	}
+
+	pthread_mutex_unlock(&sampler->mutex);
+
+	return (used < len) ? used : len;
+}
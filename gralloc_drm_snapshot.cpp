@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-SNAPSHOT"
+
+#include <cutils/log.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef ENABLE_LZ4
+#include <lz4.h>
+#endif
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+/*
+ * A snapshot is a header followed by one record per buffer, each followed
+ * by the contents of the buffer as its CPU mapping shows them: detiled
+ * where the mapping detiles, raw otherwise.  A restored buffer is
+ * allocated with the same parameters and so gets the same layout.
+ */
+#define SNAPSHOT_MAGIC 0x53445247 /* "GRDS" */
+#define SNAPSHOT_VERSION 1
+
+/* bounds on what a corrupt snapshot makes restore allocate */
+#define SNAPSHOT_MAX_DIMENSION 16384
+#define SNAPSHOT_MAX_LAYERS 64
+#define SNAPSHOT_MAX_SIZE ((uint64_t) 1 << 32)
+
+/* LZ4_MAX_INPUT_SIZE and LZ4_COMPRESSBOUND, also without lz4.h */
+#define SNAPSHOT_LZ4_MAX_INPUT_SIZE 0x7E000000
+#define SNAPSHOT_LZ4_BOUND(size) ((size) + (size) / 255 + 16)
+
+#define SNAPSHOT_MAX_THREADS 8
+/* buffers in flight per worker; bounds the memory held */
+#define SNAPSHOT_JOBS_PER_THREAD 2
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t flags;
+};
+
+struct snapshot_record {
+	int32_t width;
+	int32_t height;
+	int32_t format;
+	int32_t usage;
+	int32_t stride;
+	int32_t layer_count;
+	int32_t layer_stride;
+	uint32_t compressed;
+	uint64_t modifier;
+	uint64_t size;		/* bytes of storage */
+	uint64_t stored_size;	/* bytes that follow the record */
+};
+
+struct snapshot_job {
+	struct gralloc_drm_bo_t *bo;
+	struct snapshot_record rec;
+	void *data;
+	int err;
+};
+
+struct snapshot_batch {
+	struct snapshot_job *jobs;
+	int count;
+	int flags;
+	volatile int32_t next;
+	void (*func)(struct snapshot_job *job, int flags);
+};
+
+static int64_t snapshot_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int snapshot_threads(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads;
+
+	property_get("gralloc.drm.snapshot_threads", value, "0");
+	threads = atoi(value);
+	if (threads <= 0)
+		threads = (cpus > 4) ? 4 : (int) cpus;
+	if (threads > SNAPSHOT_MAX_THREADS)
+		threads = SNAPSHOT_MAX_THREADS;
+
+	return (threads > 0) ? threads : 1;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+
+	while (size) {
+		ssize_t n = write(fd, p, size);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t size)
+{
+	uint8_t *p = (uint8_t *) buf;
+
+	while (size) {
+		ssize_t n = read(fd, p, size);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!n)
+			return -EIO;
+		p += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static void *snapshot_worker(void *arg)
+{
+	struct snapshot_batch *batch = (struct snapshot_batch *) arg;
+
+	for (;;) {
+		int i = android_atomic_inc(&batch->next);
+
+		if (i >= batch->count)
+			break;
+		batch->func(&batch->jobs[i], batch->flags);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run func on every job of a batch on up to threads threads, the calling
+ * thread included.
+ */
+static void snapshot_run_batch(struct snapshot_batch *batch, int threads)
+{
+	pthread_t tids[SNAPSHOT_MAX_THREADS];
+	int started = 0, i;
+
+	batch->next = 0;
+	if (threads > batch->count)
+		threads = batch->count;
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[started], NULL,
+					snapshot_worker, batch))
+			break;
+		started++;
+	}
+
+	snapshot_worker(batch);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+}
+
+/*
+ * Copy the contents of a bo out, compressed when asked and worthwhile.
+ */
+static void snapshot_save_job(struct snapshot_job *job, int flags)
+{
+	struct gralloc_drm_handle_t *handle = job->bo->handle;
+	void *addr, *copy;
+	size_t size;
+
+	job->err = gralloc_drm_bo_lock_storage(job->bo, 0, &addr, &size);
+	if (job->err)
+		return;
+
+	job->rec.width = handle->width;
+	job->rec.height = handle->height;
+	job->rec.format = handle->format;
+	job->rec.usage = handle->usage;
+	job->rec.stride = handle->stride;
+	job->rec.layer_count = handle->layer_count;
+	job->rec.layer_stride = handle->layer_stride;
+	job->rec.modifier = handle->modifier;
+	job->rec.size = size;
+	job->rec.stored_size = size;
+	job->rec.compressed = 0;
+
+	/* the mapping may be uncached; never read it more than once */
+	copy = malloc(size);
+	if (!copy) {
+		job->err = -ENOMEM;
+		gralloc_drm_bo_unlock(job->bo);
+		return;
+	}
+	gralloc_drm_copy_from_uncached(copy, addr, size);
+	gralloc_drm_bo_unlock(job->bo);
+
+	job->data = copy;
+
+#ifdef ENABLE_LZ4
+	if ((flags & GRALLOC_DRM_SNAPSHOT_COMPRESS) &&
+	    size <= LZ4_MAX_INPUT_SIZE) {
+		int bound = LZ4_compressBound((int) size);
+		char *out = (char *) malloc(bound);
+		int n = 0;
+
+		if (out)
+			n = LZ4_compress_default((const char *) copy, out,
+					(int) size, bound);
+		if (n > 0 && (size_t) n < size) {
+			free(copy);
+			job->data = out;
+			job->rec.stored_size = n;
+			job->rec.compressed = 1;
+		}
+		else {
+			free(out);
+		}
+	}
+#endif
+}
+
+/*
+ * Stream the contents of count bos to fd.
+ */
+int gralloc_drm_snapshot(struct gralloc_drm_t *drm,
+		struct gralloc_drm_bo_t **bos, int count, int fd, int flags)
+{
+	struct snapshot_header header;
+	struct snapshot_batch batch;
+	struct snapshot_job *jobs;
+	int threads = snapshot_threads();
+	int per_batch = threads * SNAPSHOT_JOBS_PER_THREAD;
+	int64_t start = snapshot_now_us();
+	uint64_t raw_bytes = 0, stored_bytes = 0;
+	int saved = 0, i, j, err = 0;
+
+#ifndef ENABLE_LZ4
+	if (flags & GRALLOC_DRM_SNAPSHOT_COMPRESS)
+		ALOGW("built without LZ4; storing buffers uncompressed");
+#endif
+
+	/* aliases and foreign dma-bufs are recreated by their owners */
+	for (i = 0; i < count; i++) {
+		if (!bos[i]->parent &&
+		    !(bos[i]->handle->flags & GRALLOC_DRM_HANDLE_FLAG_EXTERNAL))
+			saved++;
+	}
+
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.count = saved;
+	header.flags = flags;
+	err = write_all(fd, &header, sizeof(header));
+	if (err)
+		return err;
+
+	jobs = (struct snapshot_job *) calloc(per_batch, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	batch.jobs = jobs;
+	batch.flags = flags;
+	batch.func = snapshot_save_job;
+
+	i = 0;
+	while (!err && i < count) {
+		batch.count = 0;
+		for (; i < count && batch.count < per_batch; i++) {
+			struct snapshot_job *job = &jobs[batch.count];
+
+			if (bos[i]->parent || (bos[i]->handle->flags &
+					GRALLOC_DRM_HANDLE_FLAG_EXTERNAL))
+				continue;
+
+			memset(job, 0, sizeof(*job));
+			job->bo = bos[i];
+			batch.count++;
+		}
+
+		snapshot_run_batch(&batch, threads);
+
+		/* records go out in order */
+		for (j = 0; j < batch.count; j++) {
+			struct snapshot_job *job = &jobs[j];
+
+			if (!err)
+				err = job->err;
+			if (!err)
+				err = write_all(fd, &job->rec, sizeof(job->rec));
+			if (!err)
+				err = write_all(fd, job->data,
+						job->rec.stored_size);
+			raw_bytes += job->rec.size;
+			stored_bytes += job->rec.stored_size;
+			free(job->data);
+		}
+	}
+
+	free(jobs);
+
+	if (err) {
+		ALOGE("snapshot failed: %s", strerror(-err));
+		return err;
+	}
+
+	ALOGI("snapshot of %d buffers, %llu bytes stored as %llu, took %lld us on %d threads",
+			saved, (unsigned long long) raw_bytes,
+			(unsigned long long) stored_bytes,
+			(long long) (snapshot_now_us() - start), threads);
+
+	return 0;
+}
+
+/*
+ * Copy saved contents into a new bo.
+ */
+static void snapshot_load_job(struct snapshot_job *job, int flags)
+{
+	void *addr, *src = job->data;
+	size_t size;
+
+	if (job->rec.compressed) {
+#ifdef ENABLE_LZ4
+		/* LZ4 reads back what it wrote; keep that off the mapping */
+		src = malloc(job->rec.size);
+		if (!src) {
+			job->err = -ENOMEM;
+			return;
+		}
+		if (LZ4_decompress_safe((const char *) job->data, (char *) src,
+					(int) job->rec.stored_size,
+					(int) job->rec.size) != (int) job->rec.size) {
+			free(src);
+			job->err = -EINVAL;
+			return;
+		}
+#else
+		job->err = -ENOTSUP;
+		return;
+#endif
+	}
+
+	job->err = gralloc_drm_bo_lock_storage(job->bo, 1, &addr, &size);
+	if (!job->err) {
+		if (size == job->rec.size)
+			memcpy(addr, src, size);
+		else
+			job->err = -EINVAL;
+		gralloc_drm_bo_unlock(job->bo);
+	}
+
+	if (src != job->data)
+		free(src);
+}
+
+/*
+ * Check that a record read back describes a buffer we would have saved.
+ */
+static int snapshot_check_record(const struct snapshot_record *rec)
+{
+	/* a blob is as wide as its size */
+	uint64_t max_width = (rec->format == HAL_PIXEL_FORMAT_BLOB) ?
+		SNAPSHOT_MAX_SIZE : SNAPSHOT_MAX_DIMENSION;
+
+	if (rec->width <= 0 || (uint64_t) rec->width > max_width ||
+	    rec->height <= 0 || rec->height > SNAPSHOT_MAX_DIMENSION ||
+	    rec->layer_count < 1 || rec->layer_count > SNAPSHOT_MAX_LAYERS ||
+	    !rec->size || rec->size > SNAPSHOT_MAX_SIZE ||
+	    rec->size > SIZE_MAX)
+		return 0;
+
+	/* LZ4 takes int sizes */
+	if (rec->compressed)
+		return rec->size <= SNAPSHOT_LZ4_MAX_INPUT_SIZE &&
+			rec->stored_size &&
+			rec->stored_size <= SNAPSHOT_LZ4_BOUND(rec->size);
+
+	return rec->stored_size == rec->size;
+}
+
+/*
+ * Recreate the bos of a snapshot read from fd.  On success, bos holds
+ * count new bos.  Only the parameters and contents are saved; content
+ * generations, damage and published rows start over as for new bos.
+ */
+int gralloc_drm_restore(struct gralloc_drm_t *drm, int fd,
+		struct gralloc_drm_bo_t **bos, int max, int *count)
+{
+	struct snapshot_header header;
+	struct snapshot_batch batch;
+	struct snapshot_job *jobs;
+	int threads = snapshot_threads();
+	int per_batch = threads * SNAPSHOT_JOBS_PER_THREAD;
+	int64_t start = snapshot_now_us();
+	int restored = 0, j, err;
+
+	err = read_all(fd, &header, sizeof(header));
+	if (err)
+		return err;
+	if (header.magic != SNAPSHOT_MAGIC ||
+	    header.version != SNAPSHOT_VERSION) {
+		ALOGE("not a snapshot of this version");
+		return -EINVAL;
+	}
+	if ((int) header.count > max)
+		return -ENOSPC;
+
+	jobs = (struct snapshot_job *) calloc(per_batch, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	batch.jobs = jobs;
+	batch.flags = header.flags;
+	batch.func = snapshot_load_job;
+
+	while (!err && restored < (int) header.count) {
+		batch.count = 0;
+		while (!err && batch.count < per_batch &&
+		       restored + batch.count < (int) header.count) {
+			struct snapshot_job *job = &jobs[batch.count];
+			struct snapshot_record *rec = &job->rec;
+
+			memset(job, 0, sizeof(*job));
+			err = read_all(fd, rec, sizeof(*rec));
+			if (err)
+				break;
+			if (!snapshot_check_record(rec)) {
+				ALOGE("invalid snapshot record of %dx%d format 0x%x",
+						rec->width, rec->height,
+						rec->format);
+				err = -EINVAL;
+				break;
+			}
+
+			job->data = malloc(rec->stored_size);
+			if (!job->data) {
+				err = -ENOMEM;
+				break;
+			}
+			err = read_all(fd, job->data, rec->stored_size);
+
+			if (!err) {
+				job->bo = gralloc_drm_bo_create_layered(drm,
+						rec->width, rec->height,
+						rec->format, rec->usage,
+						rec->layer_count);
+				if (!job->bo)
+					err = -ENOMEM;
+			}
+			/*
+			 * clients keep using the stride they were given, and
+			 * the contents are stored in the tiling of the bo
+			 */
+			if (!err && (job->bo->handle->stride != rec->stride ||
+				     job->bo->handle->layer_stride !=
+				     rec->layer_stride ||
+				     job->bo->handle->modifier != rec->modifier)) {
+				ALOGE("restored %dx%d buffer has a new layout",
+						rec->width, rec->height);
+				err = -EINVAL;
+			}
+
+			if (job->bo)
+				bos[restored + batch.count] = job->bo;
+			if (err) {
+				free(job->data);
+				if (job->bo)
+					gralloc_drm_bo_decref(job->bo);
+				break;
+			}
+			batch.count++;
+		}
+
+		if (!err)
+			snapshot_run_batch(&batch, threads);
+
+		for (j = 0; j < batch.count; j++) {
+			if (!err)
+				err = jobs[j].err;
+			free(jobs[j].data);
+		}
+		restored += batch.count;
+	}
+
+	free(jobs);
+
+	if (err) {
+		ALOGE("restore failed: %s", strerror(-err));
+		for (j = 0; j < restored; j++)
+			gralloc_drm_bo_decref(bos[j]);
+		return err;
+	}
+
+	*count = restored;
+
+	ALOGI("restored %d buffers, took %lld us on %d threads", restored,
+			(long long) (snapshot_now_us() - start), threads);
+
+	return 0;
+}
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-STATS"
+
+#include <cutils/log.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+#define STATS_MAX_FORMATS 32
+#define STATS_MAX_USAGES 8
+/* bucket i counts latencies below 2^i us */
+#define STATS_LATENCY_BUCKETS 20
+
+/*
+ * how long a snapshot may wait for a client to read it; a client that
+ * stops reading would otherwise stall the thread and
+ * gralloc_drm_stats_destroy
+ */
+#define STATS_SEND_TIMEOUT_MS 1000
+
+/* besides the uid of the process, root and these may read the stats */
+#define STATS_AID_SYSTEM 1000
+#define STATS_AID_SHELL 2000
+
+/* counters of the bos of one format or usage class */
+struct stats_class {
+	volatile uintptr_t key; /* 0 while the slot is free */
+	volatile uint64_t allocs;
+	volatile uint64_t live_count;
+	volatile uint64_t live_bytes;
+};
+
+struct gralloc_drm_stats_t {
+	char backend[32];
+	int listen_fd;
+	pthread_t thread;
+
+	volatile uint64_t counters[GRALLOC_DRM_STAT_COUNT];
+	volatile uint64_t live_count;
+	volatile uint64_t live_bytes;
+
+	struct stats_class formats[STATS_MAX_FORMATS];
+	struct stats_class usages[STATS_MAX_USAGES];
+
+	volatile uint64_t alloc_latency[STATS_LATENCY_BUCKETS];
+	volatile uint64_t lock_latency[STATS_LATENCY_BUCKETS];
+};
+
+static const char *stats_counter_names[GRALLOC_DRM_STAT_COUNT] = {
+	[GRALLOC_DRM_STAT_ALLOC]		= "allocs",
+	[GRALLOC_DRM_STAT_ALLOC_FAIL]		= "alloc_failures",
+	[GRALLOC_DRM_STAT_IMPORT]		= "imports",
+	[GRALLOC_DRM_STAT_FREE]			= "frees",
+	[GRALLOC_DRM_STAT_LOCK]			= "locks",
+	[GRALLOC_DRM_STAT_EXPORT_HIT]		= "export_cache_hits",
+	[GRALLOC_DRM_STAT_EXPORT_MISS]		= "export_cache_misses",
+	[GRALLOC_DRM_STAT_DRV_ALLOC]		= "drv_alloc",
+	[GRALLOC_DRM_STAT_DRV_EXPORT]		= "drv_export",
+	[GRALLOC_DRM_STAT_DRV_RESOLVE]		= "drv_resolve",
+	[GRALLOC_DRM_STAT_DRV_PREWARM]		= "drv_prewarm",
+	[GRALLOC_DRM_STAT_DMABUF_NAME]		= "dmabuf_set_name",
+};
+
+/*
+ * Find or claim the slot of key.  Slots are never released, so a slot
+ * once found stays valid.  Return NULL when the table is full.
+ */
+static struct stats_class *stats_class_get(struct stats_class *classes,
+		int count, uintptr_t key)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (classes[i].key == key)
+			return &classes[i];
+		if (!classes[i].key &&
+		    (__sync_bool_compare_and_swap(&classes[i].key, 0, key) ||
+		     classes[i].key == key))
+			return &classes[i];
+	}
+
+	return NULL;
+}
+
+static void stats_latency(volatile uint64_t *buckets, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int i = 0;
+
+	while (us && i < STATS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		i++;
+	}
+	__sync_fetch_and_add(&buckets[i], 1);
+}
+
+/*
+ * Count an event of a GRALLOC_DRM_STAT_* counter.
+ */
+void gralloc_drm_stats_count(struct gralloc_drm_stats_t *stats, int counter)
+{
+	__sync_fetch_and_add(&stats->counters[counter], 1);
+}
+
+/*
+ * Account a new bo and the time its allocation took.
+ */
+void gralloc_drm_stats_alloc(struct gralloc_drm_stats_t *stats,
+		int format, int usage, size_t size, uint64_t ns)
+{
+	struct stats_class *c;
+
+	__sync_fetch_and_add(&stats->counters[GRALLOC_DRM_STAT_ALLOC], 1);
+	__sync_fetch_and_add(&stats->live_count, 1);
+	__sync_fetch_and_add(&stats->live_bytes, size);
+	stats_latency(stats->alloc_latency, ns);
+
+	c = stats_class_get(stats->formats, STATS_MAX_FORMATS,
+			(uintptr_t) (uint32_t) format);
+	if (c) {
+		__sync_fetch_and_add(&c->allocs, 1);
+		__sync_fetch_and_add(&c->live_count, 1);
+		__sync_fetch_and_add(&c->live_bytes, size);
+	}
+
+	c = stats_class_get(stats->usages, STATS_MAX_USAGES,
+			(uintptr_t) gralloc_drm_usage_class(usage));
+	if (c) {
+		__sync_fetch_and_add(&c->allocs, 1);
+		__sync_fetch_and_add(&c->live_count, 1);
+		__sync_fetch_and_add(&c->live_bytes, size);
+	}
+}
+
+/*
+ * Take a destroyed bo, accounted by gralloc_drm_stats_alloc, off the
+ * live totals.
+ */
+void gralloc_drm_stats_free(struct gralloc_drm_stats_t *stats,
+		int format, int usage, size_t size)
+{
+	struct stats_class *c;
+
+	__sync_fetch_and_add(&stats->counters[GRALLOC_DRM_STAT_FREE], 1);
+	__sync_fetch_and_sub(&stats->live_count, 1);
+	__sync_fetch_and_sub(&stats->live_bytes, size);
+
+	c = stats_class_get(stats->formats, STATS_MAX_FORMATS,
+			(uintptr_t) (uint32_t) format);
+	if (c) {
+		__sync_fetch_and_sub(&c->live_count, 1);
+		__sync_fetch_and_sub(&c->live_bytes, size);
+	}
+
+	c = stats_class_get(stats->usages, STATS_MAX_USAGES,
+			(uintptr_t) gralloc_drm_usage_class(usage));
+	if (c) {
+		__sync_fetch_and_sub(&c->live_count, 1);
+		__sync_fetch_and_sub(&c->live_bytes, size);
+	}
+}
+
+/*
+ * Account a lock and the time it took.
+ */
+void gralloc_drm_stats_lock(struct gralloc_drm_stats_t *stats, uint64_t ns)
+{
+	__sync_fetch_and_add(&stats->counters[GRALLOC_DRM_STAT_LOCK], 1);
+	stats_latency(stats->lock_latency, ns);
+}
+
+/*
+ * Read a counter in one access; plain 64-bit reads may tear on 32-bit
+ * targets.
+ */
+static uint64_t stats_load(const volatile uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+struct stats_buf {
+	char *data;
+	size_t len, size;
+};
+
+static void stats_printf(struct stats_buf *buf, const char *fmt, ...)
+{
+	va_list args;
+	char *data;
+	int n;
+
+	for (;;) {
+		va_start(args, fmt);
+		n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+		va_end(args);
+
+		if (n < 0)
+			return;
+		if (buf->len + n < buf->size) {
+			buf->len += n;
+			return;
+		}
+
+		data = (char *) realloc(buf->data, buf->size * 2 + n);
+		if (!data)
+			return;
+		buf->data = data;
+		buf->size = buf->size * 2 + n;
+	}
+}
+
+static void stats_print_classes(struct stats_buf *buf, const char *name,
+		const struct stats_class *classes, int count, int is_format)
+{
+	int i, first = 1;
+
+	stats_printf(buf, "\"%s\":[", name);
+	for (i = 0; i < count; i++) {
+		const struct stats_class *c = &classes[i];
+
+		if (!c->key)
+			continue;
+
+		stats_printf(buf, "%s{", (first) ? "" : ",");
+		if (is_format)
+			stats_printf(buf, "\"format\":%u",
+					(unsigned int) c->key);
+		else
+			stats_printf(buf, "\"usage\":\"%s\"",
+					(const char *) c->key);
+		stats_printf(buf, ",\"allocs\":%llu,\"live_count\":%llu,"
+				"\"live_bytes\":%llu}",
+				(unsigned long long) stats_load(&c->allocs),
+				(unsigned long long) stats_load(&c->live_count),
+				(unsigned long long) stats_load(&c->live_bytes));
+		first = 0;
+	}
+	stats_printf(buf, "],");
+}
+
+static void stats_print_latency(struct stats_buf *buf, const char *name,
+		const volatile uint64_t *buckets)
+{
+	int i;
+
+	stats_printf(buf, "\"%s\":[", name);
+	for (i = 0; i < STATS_LATENCY_BUCKETS; i++)
+		stats_printf(buf, "%s%llu", (i) ? "," : "",
+				(unsigned long long) stats_load(&buckets[i]));
+	stats_printf(buf, "]");
+}
+
+/*
+ * Print a snapshot of the counters as one JSON object.  The counters are
+ * read without a lock, so they may be a few events apart.
+ */
+static void stats_print(struct gralloc_drm_stats_t *stats,
+		struct stats_buf *buf)
+{
+	int i;
+
+	stats_printf(buf, "{\"pid\":%d,\"backend\":\"%s\",", getpid(),
+			stats->backend);
+	stats_printf(buf, "\"live_count\":%llu,\"live_bytes\":%llu,",
+			(unsigned long long) stats_load(&stats->live_count),
+			(unsigned long long) stats_load(&stats->live_bytes));
+
+	stats_printf(buf, "\"counters\":{");
+	for (i = 0; i < GRALLOC_DRM_STAT_COUNT; i++)
+		stats_printf(buf, "%s\"%s\":%llu", (i) ? "," : "",
+				stats_counter_names[i],
+				(unsigned long long) stats_load(&stats->counters[i]));
+	stats_printf(buf, "},");
+
+	stats_print_classes(buf, "formats", stats->formats,
+			STATS_MAX_FORMATS, 1);
+	stats_print_classes(buf, "usages", stats->usages,
+			STATS_MAX_USAGES, 0);
+
+	stats_printf(buf, "\"latency_log2_us\":{");
+	stats_print_latency(buf, "alloc", stats->alloc_latency);
+	stats_printf(buf, ",");
+	stats_print_latency(buf, "lock", stats->lock_latency);
+	stats_printf(buf, "}}\n");
+}
+
+/*
+ * Check that the peer of a connection may read the stats: the uid of the
+ * process, system, shell or root.
+ */
+static int stats_peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	    len != sizeof(cred))
+		return 0;
+
+	return (cred.uid == getuid() || cred.uid == 0 ||
+		cred.uid == STATS_AID_SYSTEM || cred.uid == STATS_AID_SHELL);
+}
+
+/*
+ * Serve one snapshot to each allowed client and hang up.
+ */
+static void *stats_thread(void *arg)
+{
+	struct gralloc_drm_stats_t *stats = (struct gralloc_drm_stats_t *) arg;
+	struct timeval timeout;
+	struct stats_buf buf;
+
+	buf.size = 4096;
+	buf.data = (char *) malloc(buf.size);
+	if (!buf.data)
+		return NULL;
+
+	for (;;) {
+		size_t off = 0;
+		int fd;
+
+		fd = accept4(stats->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* the socket was shut down */
+			break;
+		}
+
+		timeout.tv_sec = STATS_SEND_TIMEOUT_MS / 1000;
+		timeout.tv_usec = STATS_SEND_TIMEOUT_MS % 1000 * 1000;
+		if (!stats_peer_allowed(fd) ||
+		    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			    sizeof(timeout))) {
+			close(fd);
+			continue;
+		}
+
+		buf.len = 0;
+		buf.data[0] = '\0';
+		stats_print(stats, &buf);
+
+		while (off < buf.len) {
+			ssize_t n = send(fd, buf.data + off, buf.len - off,
+					MSG_NOSIGNAL);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			off += n;
+		}
+		close(fd);
+	}
+
+	free(buf.data);
+
+	return NULL;
+}
+
+/*
+ * Create the counters and serve snapshots of them on the abstract Unix
+ * socket "<name>.<pid>", to peers allowed by stats_peer_allowed.  Return
+ * NULL on failure.
+ *
+ * The totals are those of the process.  They are not split by client, as
+ * alloc_device_t::alloc does not tell who a buffer is for; every process
+ * loading the module serves its own socket, so per-process totals come
+ * from scraping each.
+ */
+struct gralloc_drm_stats_t *gralloc_drm_stats_create(const char *name,
+		const char *backend)
+{
+	struct gralloc_drm_stats_t *stats;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	int len;
+
+	stats = (struct gralloc_drm_stats_t *) calloc(1, sizeof(*stats));
+	if (!stats)
+		return NULL;
+
+	snprintf(stats->backend, sizeof(stats->backend), "%s", backend);
+
+	/* the abstract namespace starts with a NUL and needs no cleanup */
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "%s.%d",
+			name, getpid());
+	if (len >= (int) sizeof(addr.sun_path) - 1) {
+		ALOGE("stats socket name %s is too long", name);
+		free(stats);
+		return NULL;
+	}
+	addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+	stats->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (stats->listen_fd < 0 ||
+	    bind(stats->listen_fd, (struct sockaddr *) &addr, addr_len) ||
+	    listen(stats->listen_fd, 4)) {
+		ALOGE("failed to listen on @%s: %s", addr.sun_path + 1,
+				strerror(errno));
+		if (stats->listen_fd >= 0)
+			close(stats->listen_fd);
+		free(stats);
+		return NULL;
+	}
+
+	if (pthread_create(&stats->thread, NULL, stats_thread, stats)) {
+		ALOGE("failed to start the stats thread");
+		close(stats->listen_fd);
+		free(stats);
+		return NULL;
+	}
+
+	ALOGI("serving stats on @%s", addr.sun_path + 1);
+
+	return stats;
+}
+
+void gralloc_drm_stats_destroy(struct gralloc_drm_stats_t *stats)
+{
+	/* wakes the thread up from accept */
+	shutdown(stats->listen_fd, SHUT_RDWR);
+	pthread_join(stats->thread, NULL);
+	close(stats->listen_fd);
+	free(stats);
+}
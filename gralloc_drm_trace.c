@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-TRACE"
+
+#include <cutils/log.h>
+#include <cutils/atomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+#include "gralloc_drm_trace.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct trace_ring {
+	/* events ever recorded; the slot of the next is head % size */
+	volatile int32_t head;
+	/* the thread recording into the ring, or 0 when it is free */
+	volatile int32_t tid;
+	struct trace_ring *next;
+	struct gralloc_drm_event_t events[GRALLOC_DRM_TRACE_RING_SIZE];
+};
+
+/*
+ * how long the events of an exited thread are kept for a post-mortem
+ * before its ring is handed to a new thread
+ */
+#define TRACE_RING_AGE_NS (60 * 1000000000ull)
+
+/* rings are never freed; exited threads hand theirs to new ones */
+static struct trace_ring *volatile trace_rings;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *trace_ring;
+
+/* where fatal signals dump the rings, up to the pid */
+static char trace_prefix[PATH_MAX];
+static const int trace_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+static struct sigaction trace_old_actions[ARRAY_SIZE(trace_signals)];
+
+static void trace_thread_exit(void *arg)
+{
+	struct trace_ring *ring = (struct trace_ring *) arg;
+
+	android_atomic_release_store(0, &ring->tid);
+}
+
+static void trace_init_key(void)
+{
+	pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+/*
+ * Return non-zero when the last event of a free ring is older than
+ * TRACE_RING_AGE_NS, so that its history no longer matters.
+ */
+static int trace_ring_aged(struct trace_ring *ring, uint64_t now)
+{
+	uint32_t head = android_atomic_acquire_load(&ring->head);
+
+	if (!head)
+		return 1;
+
+	return (now - ring->events[(head - 1) %
+			GRALLOC_DRM_TRACE_RING_SIZE].time > TRACE_RING_AGE_NS);
+}
+
+static struct trace_ring *trace_get_ring(void)
+{
+	struct trace_ring *ring;
+	struct timespec ts;
+	uint64_t now;
+	int32_t tid;
+
+	if (trace_ring)
+		return trace_ring;
+
+	pthread_once(&trace_once, trace_init_key);
+	tid = (int32_t) syscall(SYS_gettid);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	/* take over the ring of a thread that exited long enough ago */
+	for (ring = trace_rings; ring; ring = ring->next) {
+		if (!android_atomic_acquire_load(&ring->tid) &&
+		    trace_ring_aged(ring, now) &&
+		    !android_atomic_acquire_cas(0, tid, &ring->tid))
+			break;
+	}
+
+	if (!ring) {
+		ring = (struct trace_ring *) calloc(1, sizeof(*ring));
+		if (!ring)
+			return NULL;
+		ring->tid = tid;
+		do {
+			ring->next = trace_rings;
+		} while (!__sync_bool_compare_and_swap(&trace_rings,
+					ring->next, ring));
+	}
+	else {
+		android_atomic_release_store(0, &ring->head);
+	}
+
+	pthread_setspecific(trace_key, ring);
+	trace_ring = ring;
+
+	return ring;
+}
+
+/*
+ * Record an event in the ring of the calling thread.  Only the owner
+ * writes a ring, so this takes no lock.
+ */
+void gralloc_drm_trace(uint32_t type, uint32_t id, uint32_t arg0,
+		uint32_t arg1)
+{
+	struct trace_ring *ring = trace_get_ring();
+	struct gralloc_drm_event_t *ev;
+	struct timespec ts;
+	int32_t head;
+
+	if (!ring)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	head = ring->head;
+	ev = &ring->events[(uint32_t) head % GRALLOC_DRM_TRACE_RING_SIZE];
+	ev->time = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	ev->id = id;
+	ev->type = type;
+	ev->arg0 = arg0;
+	ev->arg1 = arg1;
+	android_atomic_release_store(head + 1, &ring->head);
+}
+
+static int trace_write(int fd, const void *buf, size_t size)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+
+	while (size) {
+		ssize_t n = write(fd, p, size);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Write every ring to fd.  This is async-signal-safe: it neither locks
+ * nor allocates.  The events being overwritten while it runs are
+ * dropped.
+ */
+int gralloc_drm_trace_dump(int fd)
+{
+	struct gralloc_drm_trace_header_t header;
+	struct trace_ring *ring;
+	int err;
+
+	header.magic = GRALLOC_DRM_TRACE_MAGIC;
+	header.version = GRALLOC_DRM_TRACE_VERSION;
+	header.pid = getpid();
+	header.count = 0;
+	for (ring = trace_rings; ring; ring = ring->next)
+		header.count++;
+
+	err = trace_write(fd, &header, sizeof(header));
+	if (err)
+		return err;
+
+	for (ring = trace_rings; ring; ring = ring->next) {
+		struct gralloc_drm_trace_ring_header_t rh;
+		uint32_t head = android_atomic_acquire_load(&ring->head);
+		uint32_t first = (head > GRALLOC_DRM_TRACE_RING_SIZE) ?
+			head - GRALLOC_DRM_TRACE_RING_SIZE : 0;
+		uint32_t i;
+
+		/* the owner may write one slot ahead while we read */
+		if (head - first == GRALLOC_DRM_TRACE_RING_SIZE)
+			first++;
+
+		rh.tid = ring->tid;
+		rh.count = head - first;
+		err = trace_write(fd, &rh, sizeof(rh));
+		for (i = first; !err && i < head; i++)
+			err = trace_write(fd, &ring->events[i %
+					GRALLOC_DRM_TRACE_RING_SIZE],
+					sizeof(struct gralloc_drm_event_t));
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static const char *trace_event_name(uint32_t type)
+{
+	switch (type) {
+	case GRALLOC_DRM_EVENT_ALLOC:	return "alloc";
+	case GRALLOC_DRM_EVENT_IMPORT:	return "import";
+	case GRALLOC_DRM_EVENT_LOCK:	return "lock";
+	case GRALLOC_DRM_EVENT_UNLOCK:	return "unlock";
+	case GRALLOC_DRM_EVENT_RESOLVE:	return "resolve";
+	case GRALLOC_DRM_EVENT_FREE:	return "free";
+	default:			return "?";
+	}
+}
+
+/*
+ * Print the last events of every thread as text, for dumpsys.  Return the
+ * length printed.
+ */
+int gralloc_drm_trace_print(char *buf, int len, int per_thread)
+{
+	struct trace_ring *ring;
+	int used = 0;
+
+	for (ring = trace_rings; ring && used < len; ring = ring->next) {
+		uint32_t head = android_atomic_acquire_load(&ring->head);
+		uint32_t i = (head > (uint32_t) per_thread) ? head - per_thread : 0;
+
+		if (!head)
+			continue;
+
+		used += snprintf(buf + used, len - used, "thread %d:\n",
+				ring->tid);
+		for (; i < head && used < len; i++) {
+			const struct gralloc_drm_event_t *ev =
+				&ring->events[i % GRALLOC_DRM_TRACE_RING_SIZE];
+
+			used += snprintf(buf + used, len - used,
+					"  %llu.%06llu %-7s bo %u 0x%x 0x%x\n",
+					(unsigned long long) ev->time / 1000000000,
+					(unsigned long long) ev->time % 1000000000 / 1000,
+					trace_event_name(ev->type), ev->id,
+					ev->arg0, ev->arg1);
+		}
+	}
+
+	return (used < len) ? used : len;
+}
+
+/*
+ * Format the dump path of the calling process.  The pid is taken now, as
+ * forked children inherit the handler.  This is async-signal-safe.
+ */
+static void trace_format_path(char *path, size_t size)
+{
+	static const char suffix[] = ".bin";
+	char digits[16];
+	size_t len = strlen(trace_prefix);
+	int pid = getpid();
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + pid % 10;
+		pid /= 10;
+	} while (pid && n < (int) sizeof(digits));
+
+	if (len + n + sizeof(suffix) > size) {
+		path[0] = '\0';
+		return;
+	}
+
+	memcpy(path, trace_prefix, len);
+	while (n)
+		path[len++] = digits[--n];
+	memcpy(path + len, suffix, sizeof(suffix));
+}
+
+static void trace_signal_handler(int sig, siginfo_t *info, void *ctx)
+{
+	const struct sigaction *old;
+	char path[PATH_MAX];
+	unsigned int i;
+	int fd;
+
+	trace_format_path(path, sizeof(path));
+	fd = (path[0]) ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0640) : -1;
+	if (fd >= 0) {
+		gralloc_drm_trace_dump(fd);
+		close(fd);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(trace_signals); i++) {
+		if (trace_signals[i] == sig)
+			break;
+	}
+	if (i == ARRAY_SIZE(trace_signals))
+		return;
+	old = &trace_old_actions[i];
+	sigaction(sig, old, NULL);
+
+	/*
+	 * let the previous handler, usually debuggerd's, take it from here
+	 * with the original siginfo, so that tombstones keep the fault
+	 * address and si_code
+	 */
+	if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+		if (old->sa_flags & SA_SIGINFO)
+			old->sa_sigaction(sig, info, ctx);
+		else
+			old->sa_handler(sig);
+		return;
+	}
+
+	/*
+	 * a fault raised by the kernel recurs with its siginfo when the
+	 * faulting instruction is retried; one sent by a thread, such as
+	 * abort()'s, is sent again
+	 */
+	if (info->si_code <= 0)
+		raise(sig);
+}
+
+/*
+ * Dump the rings to a file in dir when the process dies of a fatal
+ * signal.
+ */
+void gralloc_drm_trace_install(const char *dir)
+{
+	static int installed;
+	struct sigaction sa;
+	unsigned int i;
+
+	if (installed)
+		return;
+	installed = 1;
+
+	snprintf(trace_prefix, sizeof(trace_prefix), "%s/gralloc-recorder-",
+			dir);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = trace_signal_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+
+	for (i = 0; i < ARRAY_SIZE(trace_signals); i++)
+		sigaction(trace_signals[i], &sa, &trace_old_actions[i]);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GRALLOC_DRM_TRACE_H_
+#define _GRALLOC_DRM_TRACE_H_
+
+/*
+ * The flight recorder: every thread records gralloc events into a ring of
+ * its own.  The rings are dumped in the format below, which
+ * gralloc_drm_trace_decode renders as a timeline.  This header is shared
+ * with the host tool and must not depend on Android headers.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	GRALLOC_DRM_EVENT_ALLOC = 1,	/* arg0: size, arg1: usage */
+	GRALLOC_DRM_EVENT_IMPORT,	/* arg0: size, arg1: usage */
+	GRALLOC_DRM_EVENT_LOCK,		/* arg0: usage, arg1: error */
+	GRALLOC_DRM_EVENT_UNLOCK,	/* arg0: lock state before */
+	GRALLOC_DRM_EVENT_RESOLVE,	/* arg0: fd, arg1: error */
+	GRALLOC_DRM_EVENT_FREE,		/* arg0: size */
+};
+
+struct gralloc_drm_event_t {
+	uint64_t time;	/* CLOCK_MONOTONIC, in ns */
+	uint32_t id;	/* of the bo, unique within the process */
+	uint32_t type;	/* GRALLOC_DRM_EVENT_* */
+	uint32_t arg0;
+	uint32_t arg1;
+};
+
+/* events kept per thread */
+#define GRALLOC_DRM_TRACE_RING_SIZE 256
+
+#define GRALLOC_DRM_TRACE_MAGIC 0x52464447 /* "GDFR" */
+#define GRALLOC_DRM_TRACE_VERSION 1
+
+/* a dump is this header followed by count rings */
+struct gralloc_drm_trace_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t count;
+};
+
+/* each ring is this header followed by count events, oldest first */
+struct gralloc_drm_trace_ring_header_t {
+	uint32_t tid;
+	uint32_t count;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _GRALLOC_DRM_TRACE_H_ */
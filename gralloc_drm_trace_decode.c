@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Print a flight recorder dump of gralloc as one timeline, merging the
+ * rings of all threads:
+ *
+ *   gralloc_drm_trace_decode gralloc-recorder-<pid>.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gralloc_drm_trace.h"
+
+struct event {
+	struct gralloc_drm_event_t ev;
+	uint32_t tid;
+};
+
+static const char *event_name(uint32_t type)
+{
+	switch (type) {
+	case GRALLOC_DRM_EVENT_ALLOC:	return "alloc";
+	case GRALLOC_DRM_EVENT_IMPORT:	return "import";
+	case GRALLOC_DRM_EVENT_LOCK:	return "lock";
+	case GRALLOC_DRM_EVENT_UNLOCK:	return "unlock";
+	case GRALLOC_DRM_EVENT_RESOLVE:	return "resolve";
+	case GRALLOC_DRM_EVENT_FREE:	return "free";
+	default:			return "?";
+	}
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+	const struct event *ea = (const struct event *) a;
+	const struct event *eb = (const struct event *) b;
+
+	if (ea->ev.time != eb->ev.time)
+		return (ea->ev.time < eb->ev.time) ? -1 : 1;
+	return 0;
+}
+
+static void print_event(const struct event *e, uint64_t start)
+{
+	uint64_t t = e->ev.time - start;
+
+	printf("%6llu.%06llu %6u %-7s bo %-5u ",
+			(unsigned long long) t / 1000000000,
+			(unsigned long long) t % 1000000000 / 1000,
+			e->tid, event_name(e->ev.type), e->ev.id);
+
+	switch (e->ev.type) {
+	case GRALLOC_DRM_EVENT_ALLOC:
+	case GRALLOC_DRM_EVENT_IMPORT:
+		printf("size %u usage 0x%x\n", e->ev.arg0, e->ev.arg1);
+		break;
+	case GRALLOC_DRM_EVENT_LOCK:
+		printf("usage 0x%x err %d\n", e->ev.arg0, (int) e->ev.arg1);
+		break;
+	case GRALLOC_DRM_EVENT_UNLOCK:
+		printf("state 0x%x\n", e->ev.arg0);
+		break;
+	case GRALLOC_DRM_EVENT_RESOLVE:
+		printf("fd %d err %d\n", (int) e->ev.arg0, (int) e->ev.arg1);
+		break;
+	case GRALLOC_DRM_EVENT_FREE:
+		printf("size %u\n", e->ev.arg0);
+		break;
+	default:
+		printf("0x%x 0x%x\n", e->ev.arg0, e->ev.arg1);
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct gralloc_drm_trace_header_t header;
+	struct event *events = NULL;
+	size_t count = 0, i;
+	uint32_t r;
+	FILE *fp;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <recorder dump>\n", argv[0]);
+		return 1;
+	}
+
+	fp = fopen(argv[1], "rb");
+	if (!fp) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != GRALLOC_DRM_TRACE_MAGIC) {
+		fprintf(stderr, "%s is not a gralloc recorder dump\n", argv[1]);
+		fclose(fp);
+		return 1;
+	}
+	if (header.version != GRALLOC_DRM_TRACE_VERSION) {
+		fprintf(stderr, "unsupported dump version %u\n", header.version);
+		fclose(fp);
+		return 1;
+	}
+
+	for (r = 0; r < header.count; r++) {
+		struct gralloc_drm_trace_ring_header_t rh;
+		struct event *tmp;
+		uint32_t j;
+
+		if (fread(&rh, sizeof(rh), 1, fp) != 1 ||
+		    rh.count > GRALLOC_DRM_TRACE_RING_SIZE) {
+			fprintf(stderr, "truncated dump, ring %u\n", r);
+			break;
+		}
+
+		tmp = (struct event *) realloc(events,
+				sizeof(*events) * (count + rh.count));
+		if (!tmp) {
+			fprintf(stderr, "out of memory\n");
+			break;
+		}
+		events = tmp;
+
+		for (j = 0; j < rh.count; j++) {
+			if (fread(&events[count].ev, sizeof(events[count].ev),
+						1, fp) != 1)
+				break;
+			events[count].tid = rh.tid;
+			count++;
+		}
+		if (j < rh.count) {
+			fprintf(stderr, "truncated dump, ring %u\n", r);
+			break;
+		}
+	}
+	fclose(fp);
+
+	qsort(events, count, sizeof(*events), event_cmp);
+
+	printf("pid %u, %u threads, %zu events\n", header.pid, header.count,
+			count);
+	for (i = 0; i < count; i++)
+		print_event(&events[i], events[0].ev.time);
+
+	free(events);
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "GRALLOC-WORKER"
+
+#include <cutils/log.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_drm_priv.h"
+
+struct gralloc_drm_job_t {
+	void (*func)(void *data);
+	void *data;
+	struct gralloc_drm_job_t *next;
+};
+
+struct gralloc_drm_worker_t {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* jobs run in the order they are queued */
+	struct gralloc_drm_job_t *head, *tail;
+	int quit;
+
+	int nice; /* of the thread */
+};
+
+static void *worker_thread(void *arg)
+{
+	struct gralloc_drm_worker_t *worker = (struct gralloc_drm_worker_t *) arg;
+
+	if (worker->nice &&
+	    setpriority(PRIO_PROCESS, syscall(SYS_gettid), worker->nice))
+		ALOGW("failed to set the worker priority to %d", worker->nice);
+
+	pthread_mutex_lock(&worker->mutex);
+	for (;;) {
+		struct gralloc_drm_job_t *job = worker->head;
+
+		if (!job) {
+			if (worker->quit)
+				break;
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+			continue;
+		}
+
+		worker->head = job->next;
+		if (!worker->head)
+			worker->tail = NULL;
+
+		pthread_mutex_unlock(&worker->mutex);
+		job->func(job->data);
+		free(job);
+		pthread_mutex_lock(&worker->mutex);
+	}
+	pthread_mutex_unlock(&worker->mutex);
+
+	return NULL;
+}
+
+/*
+ * Create a thread running the jobs queued to it at the given nice level.
+ */
+struct gralloc_drm_worker_t *gralloc_drm_worker_create(int nice)
+{
+	struct gralloc_drm_worker_t *worker;
+
+	worker = (struct gralloc_drm_worker_t *) calloc(1, sizeof(*worker));
+	if (!worker)
+		return NULL;
+
+	worker->nice = nice;
+
+	pthread_mutex_init(&worker->mutex, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+
+	if (pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+		ALOGE("failed to start the worker thread");
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+		free(worker);
+		return NULL;
+	}
+
+	return worker;
+}
+
+/*
+ * Run the jobs still queued and stop the thread.
+ */
+void gralloc_drm_worker_destroy(struct gralloc_drm_worker_t *worker)
+{
+	pthread_mutex_lock(&worker->mutex);
+	worker->quit = 1;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+
+	pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->mutex);
+	free(worker);
+}
+
+/*
+ * Queue func(data) to run on the worker thread.
+ */
+int gralloc_drm_worker_queue(struct gralloc_drm_worker_t *worker,
+		void (*func)(void *data), void *data)
+{
+	struct gralloc_drm_job_t *job;
+
+	job = (struct gralloc_drm_job_t *) malloc(sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	job->func = func;
+	job->data = data;
+	job->next = NULL;
+
+	pthread_mutex_lock(&worker->mutex);
+	if (worker->tail)
+		worker->tail->next = job;
+	else
+		worker->head = job;
+	worker->tail = job;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+
+	return 0;
+}
@@ -25,6 +25,16 @@
 
 #include "util.h"
 
+#ifndef DRM_FORMAT_ABGR16161616F
+#define DRM_FORMAT_ABGR16161616F fourcc_code('A', 'B', '4', 'H')
+#endif
+#ifndef DRM_FORMAT_P010
+#define DRM_FORMAT_P010 fourcc_code('P', '0', '1', '0')
+#endif
+#ifndef DRM_FORMAT_P016
+#define DRM_FORMAT_P016 fourcc_code('P', '0', '1', '6')
+#endif
+
 #if !defined(DRM_CAP_CURSOR_WIDTH)
 #define DRM_CAP_CURSOR_WIDTH 0x8
 #endif
@@ -48,6 +58,20 @@ uint32_t get_fourcc_format_for_hal_format(uint32_t hal_format) {
 		return DRM_FORMAT_ARGB8888;
 	case HAL_PIXEL_FORMAT_RGB_565:
 		return DRM_FORMAT_RGB565;
+	case HAL_PIXEL_FORMAT_BLOB:
+	case HAL_PIXEL_FORMAT_Y8:
+		return DRM_FORMAT_R8;
+	case HAL_PIXEL_FORMAT_Y16:
+	case HAL_PIXEL_FORMAT_RAW16:
+		return DRM_FORMAT_R16;
+	case HAL_PIXEL_FORMAT_RAW10:
+	case HAL_PIXEL_FORMAT_RAW12:
+		/* packed Bayer data has no DRM equivalent */
+		return 0;
+	case HAL_PIXEL_FORMAT_RGBA_1010102:
+		return DRM_FORMAT_ABGR2101010;
+	case HAL_PIXEL_FORMAT_RGBA_FP16:
+		return DRM_FORMAT_ABGR16161616F;
 	case HAL_PIXEL_FORMAT_YV12:
 	case HAL_PIXEL_FORMAT_YCbCr_420_888:
 		return DRM_FORMAT_YUV420;
@@ -57,6 +81,12 @@ uint32_t get_fourcc_format_for_hal_format(uint32_t hal_format) {
 		return DRM_FORMAT_NV16;
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
 		return DRM_FORMAT_NV21;
+	case HAL_PIXEL_FORMAT_DRM_NV12:
+		return DRM_FORMAT_NV12;
+	case HAL_PIXEL_FORMAT_DRM_P010:
+		return DRM_FORMAT_P010;
+	case HAL_PIXEL_FORMAT_DRM_P016:
+		return DRM_FORMAT_P016;
 	default:
 		ALOGI("Unknown HAL Format 0x%x", hal_format);
 		return 0;